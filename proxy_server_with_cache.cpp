@@ -2,292 +2,4661 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <unordered_map>
+#include <map>
 #include <list>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <coroutine>
+#include <thread>
+#include <random>
 #include <algorithm> // For std::transform
 #include <cstring>
+#include <csignal>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <errno.h>
+#include <time.h>
 
 using namespace std;
 
-#define MAX_BYTES 4096    
-#define MAX_CLIENTS 400     
+#define MAX_BYTES 4096
+#define MAX_CLIENTS 65536   // Concurrent client connections held by the event loop
 #define MAX_CACHE_SIZE 200 * (1 << 20) // 200MB size limit
+#define CACHE_SHARDS 16                // Cache shards, each with its own lock (power of two, -S)
+#define EVICTION_POLICY "clock"        // Default cache eviction policy (-E)
+#define MAX_VARIANTS 8                 // Responses cached per URL that differ by Vary
+#define ADMISSION_WINDOW 65536         // Misses per shard remembered for cache admission (-a)
+#define MAX_HEADER_SIZE 64 * 1024      // 64KB Safety Limit
+#define MAX_ELEMENT_SIZE 10 * (1 << 20) // Default largest body captured for the cache (-o)
+#define SPLICE_CHUNK 64 * 1024         // Bytes moved per splice() (default pipe capacity)
+#define MEMFD_MIN_SIZE 64 * 1024       // Smallest body kept in a memfd with -c memfd
+#define BUF_RING_SIZE 16 * (1 << 20)   // Provided-buffer memory per io_uring loop
+#define HANDOFF_QUEUE_SIZE 4096        // Accepted fds waiting for a worker (power of two)
+#define CONNECT_TIMEOUT_MS 10000       // Default upstream connect deadline (-t)
+#define HAPPY_EYEBALLS_DELAY 250       // ms before racing the next address (RFC 8305)
+#define DNS_TIMEOUT_MS 1000            // Wait before resending a DNS query
+#define DNS_TRIES 3                    // Sends per query before the lookup fails
+#define DNS_MAX_TTL 3600               // Longest a DNS answer is cached (s)
+#define DNS_FAILURE_TTL 5              // How long timeouts and SERVFAILs are cached (s)
+#define DNS_CACHE_SIZE 4096            // Cached host names
+#define UPSTREAM_MAX_IDLE 8            // Idle keep-alive connections kept per origin (-u)
+#define UPSTREAM_IDLE_TIMEOUT_MS 30000 // Idle origin connections are closed after this (-U)
+#define CLIENT_IDLE_TIMEOUT_MS 15000   // Client connections waiting this long for a request are closed (-k)
+#define CLIENT_MAX_REQUESTS 100        // Requests served per client connection (-m)
+#define PIPELINE_DEPTH 8               // Pipelined requests in flight per client connection
 
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
 #endif
 
-struct SemGuard {
-    sem_t* sem;
-    SemGuard(sem_t* s) : sem(s) {}
-    ~SemGuard() { sem_post(sem); }
+
+// What a cached response is filed under: the canonical form of its
+// request (see cacheKey) and that string's hash.
+struct CacheKey {
+    string text;
+    size_t hash = 0;
+};
+
+// An immutable cached response, shared by the cache and every in-flight
+// hit; an evicted body stays valid until its last sender lets go.
+struct CacheBody {
+    string data;
+    int fd = -1;  // sealed memfd holding the body instead of data
+    size_t size = 0;
+    size_t head_len = 0; // response head, blank line included
+    bool framed = false; // ends where its head says, so the client connection can stay open
+    vector<string> vary; // request headers the response varies on, lowercased
+    string selector;     // the fetching request's values for them (see varySelector)
+
+    ~CacheBody() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+// A miss being fetched from the origin. The request fetching it (the
+// leader) fills body; concurrent misses on the same key follow it rather
+// than going upstream themselves. A body of known length is reserved up
+// front so followers can send each part as soon as it lands; any other
+// body is followed once it is complete.
+struct Fetch {
+    enum State { PENDING, STREAMING, DONE, ABANDONED, FAILED };
+
+    mutex lock;
+    State state = PENDING;
+    shared_ptr<CacheBody> body = make_shared<CacheBody>(); // data, head_len, framed set before STREAMING
+    const char* base = nullptr; // body->data's bytes once they stop moving
+    size_t avail = 0;           // bytes from base that followers may send
+    int status = 0;             // FAILED: the error response the leader sent, if any
+    atomic<bool> admit{true};   // store the body when DONE; set by the cache
+    vector<function<void()>> waiters;
+
+    // Leader only: moves the fetch on and wakes the followers waiting on it.
+    void update(State s, size_t n, int error = 0) {
+        vector<function<void()>> wake;
+        {
+            lock_guard<mutex> guard(lock);
+            if (state >= DONE) return; // already over
+            state = s;
+            avail = n;
+            status = error;
+            base = body->data.data();
+            wake.swap(waiters);
+        }
+        for (function<void()>& w : wake) w();
+    }
+};
+
+// Epoch-based reclamation for structures read without a lock. A reader
+// announces the global epoch for the length of its lookup; memory a
+// writer unlinks is retired with the epoch it was retired in and freed
+// once the global epoch is two past it, by which time every reader that
+// could have seen it has left. The epoch only advances when every active
+// reader has caught up with it.
+class Epoch {
+private:
+    struct alignas(64) Record {
+        atomic<uint64_t> local{0}; // announced epoch, 0 when outside a read
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        function<void()> free;
+    };
+
+    static const size_t RECLAIM_BATCH = 64; // retirements between reclaim passes
+
+    static atomic<uint64_t> global;
+    static mutex lock; // guards records and retired
+    static vector<Record*> records;
+    static deque<Retired> retired;
+    static thread_local Record* self;
+
+    static Record* record() {
+        if (!self) {
+            self = new Record(); // threads outlive the cache; never freed
+            lock_guard<mutex> guard(lock);
+            records.push_back(self);
+        }
+        return self;
+    }
+
+    // Under lock: moves the epoch on if no reader lags, then frees what
+    // no reader can still hold.
+    static void reclaim(vector<function<void()>>& done) {
+        uint64_t e = global.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool lagging = false;
+        for (Record* r : records) {
+            uint64_t l = r->local.load(memory_order_acquire);
+            if (l != 0 && l != e) lagging = true;
+        }
+        if (!lagging) global.store(++e, memory_order_release);
+        while (!retired.empty() && retired.front().epoch + 2 <= e) {
+            done.push_back(move(retired.front().free));
+            retired.pop_front();
+        }
+    }
+
+public:
+    // Scope of one lock-free read.
+    class Guard {
+    private:
+        Record* r;
+
+    public:
+        Guard() : r(record()) {
+            r->local.store(global.load(memory_order_relaxed), memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+        }
+        ~Guard() { r->local.store(0, memory_order_release); }
+    };
+
+    // Runs free once no reader can still see what the caller has just
+    // unlinked.
+    static void retire(function<void()> free) {
+        vector<function<void()>> done;
+        {
+            lock_guard<mutex> guard(lock);
+            retired.push_back({global.load(memory_order_relaxed), move(free)});
+            if (retired.size() % RECLAIM_BATCH == 0) reclaim(done);
+        }
+        for (function<void()>& f : done) f();
+    }
+};
+
+atomic<uint64_t> Epoch::global{1};
+mutex Epoch::lock;
+vector<Epoch::Record*> Epoch::records;
+deque<Epoch::Retired> Epoch::retired;
+thread_local Epoch::Record* Epoch::self = NULL;
+
+// A stored response as the index and the eviction policies see it.
+struct CacheEntry {
+    string url;
+    size_t hash;
+    size_t charge; // bytes counted against the shard's budget
+    atomic<shared_ptr<const CacheBody>> body; // fixed once visible; let go when the entry is unlinked
+    atomic<uint8_t> freq{0};          // hits, saturating at 3; bumped without the lock
+    atomic<CacheEntry*> next_variant{nullptr}; // another response stored for url (Vary)
+    bool resident = false;            // in the index; under the shard lock
+    uint8_t queue = 0;                // which of its policy's queues holds it
+    list<CacheEntry*>::iterator pos;
+};
+
+// Entries in insertion or recency order, newest first, with their bytes.
+struct EntryQueue {
+    list<CacheEntry*> items;
+    size_t bytes = 0;
+
+    void push(CacheEntry* e, uint8_t queue) {
+        items.push_front(e);
+        e->pos = items.begin();
+        e->queue = queue;
+        bytes += e->charge;
+    }
+    void erase(CacheEntry* e) {
+        items.erase(e->pos);
+        bytes -= e->charge;
+    }
+    void touch(CacheEntry* e) { items.splice(items.begin(), items, e->pos); }
+    CacheEntry* oldest() const { return items.empty() ? nullptr : items.back(); }
+};
+
+// Keys evicted recently, remembered by hash and charge up to a byte limit.
+struct GhostQueue {
+    list<pair<size_t, size_t>> items; // newest first
+    unordered_map<size_t, list<pair<size_t, size_t>>::iterator> index;
+    size_t bytes = 0;
+
+    void push(size_t hash, size_t charge, size_t limit) {
+        erase(hash);
+        items.push_front({hash, charge});
+        index[hash] = items.begin();
+        bytes += charge;
+        while (bytes > limit && !items.empty()) {
+            bytes -= items.back().second;
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+    }
+    bool erase(size_t hash) {
+        auto it = index.find(hash);
+        if (it == index.end()) return false;
+        bytes -= it->second->second;
+        items.erase(it->second);
+        index.erase(it);
+        return true;
+    }
+};
+
+// Chooses what a cache shard evicts. Every call is made under the shard
+// lock. Hits bump CacheEntry::freq without it; a policy that also needs
+// to see hits in order sets ordered(), and its hit() is then called for
+// each hit that finds the shard lock free.
+class EvictionPolicy {
+public:
+    virtual ~EvictionPolicy() {}
+    virtual const char* name() const = 0;
+    virtual bool ordered() const { return false; }
+    virtual void hit(CacheEntry*) {}
+    virtual void miss(size_t) {} // a lookup of this key hash found nothing
+    virtual void insert(CacheEntry* e) = 0;
+    virtual void erase(CacheEntry* e) = 0;
+    // Detaches and returns the next entry to go; null when there is none.
+    virtual CacheEntry* evict() = 0;
+};
+
+// Strict least recently used.
+class LruPolicy : public EvictionPolicy {
+private:
+    EntryQueue queue;
+
+public:
+    const char* name() const override { return "lru"; }
+    bool ordered() const override { return true; }
+    void hit(CacheEntry* e) override { queue.touch(e); }
+    void insert(CacheEntry* e) override { queue.push(e, 0); }
+    void erase(CacheEntry* e) override { queue.erase(e); }
+    CacheEntry* evict() override {
+        CacheEntry* e = queue.oldest();
+        if (e) queue.erase(e);
+        return e;
+    }
+};
+
+// Second chance: the oldest entry goes unless it was hit since it was last
+// passed over, in which case it is moved to the front with its hits cleared.
+class ClockPolicy : public EvictionPolicy {
+private:
+    EntryQueue queue;
+
+public:
+    const char* name() const override { return "clock"; }
+    void insert(CacheEntry* e) override { queue.push(e, 0); }
+    void erase(CacheEntry* e) override { queue.erase(e); }
+    CacheEntry* evict() override {
+        while (CacheEntry* e = queue.oldest()) {
+            if (e->freq.load(memory_order_relaxed) == 0) {
+                queue.erase(e);
+                return e;
+            }
+            e->freq.store(0, memory_order_relaxed);
+            queue.touch(e);
+        }
+        return nullptr;
+    }
+};
+
+// Adaptive replacement (Megiddo & Modha), weighted by bytes: a recency
+// and a frequency list, each shadowed by a ghost list of keys it evicted.
+// A miss on a ghost key moves the byte target for the recency list
+// toward the side that would have kept it.
+class ArcPolicy : public EvictionPolicy {
+private:
+    enum { RECENT, FREQUENT };
+    EntryQueue queues[2];
+    GhostQueue ghosts[2];
+    size_t capacity;
+    size_t target = 0; // bytes the recency list may hold before it yields
+
+public:
+    ArcPolicy(size_t cap) : capacity(cap) {}
+    const char* name() const override { return "arc"; }
+    bool ordered() const override { return true; }
+
+    void hit(CacheEntry* e) override {
+        if (e->queue == FREQUENT) {
+            queues[FREQUENT].touch(e);
+            return;
+        }
+        queues[RECENT].erase(e);
+        queues[FREQUENT].push(e, FREQUENT);
+    }
+
+    void insert(CacheEntry* e) override {
+        size_t recent = ghosts[RECENT].bytes, frequent = ghosts[FREQUENT].bytes;
+        if (ghosts[RECENT].erase(e->hash)) {
+            size_t delta = recent >= frequent ? e->charge : e->charge * (frequent / recent);
+            target = min(capacity, target + delta);
+            queues[FREQUENT].push(e, FREQUENT);
+        } else if (ghosts[FREQUENT].erase(e->hash)) {
+            size_t delta = frequent >= recent ? e->charge : e->charge * (recent / frequent);
+            target = target > delta ? target - delta : 0;
+            queues[FREQUENT].push(e, FREQUENT);
+        } else {
+            queues[RECENT].push(e, RECENT);
+        }
+    }
+
+    void erase(CacheEntry* e) override { queues[e->queue].erase(e); }
+
+    CacheEntry* evict() override {
+        int from = !queues[RECENT].items.empty() &&
+                           (queues[RECENT].bytes > target || queues[FREQUENT].items.empty())
+                       ? RECENT
+                       : FREQUENT;
+        CacheEntry* e = queues[from].oldest();
+        if (!e) return nullptr;
+        queues[from].erase(e);
+        // The recency side and its ghosts stay within the capacity, all
+        // four lists within twice it.
+        if (from == RECENT) {
+            ghosts[RECENT].push(e->hash, e->charge, capacity - min(capacity, queues[RECENT].bytes));
+        } else {
+            size_t rest = queues[RECENT].bytes + queues[FREQUENT].bytes + ghosts[RECENT].bytes;
+            ghosts[FREQUENT].push(e->hash, e->charge, 2 * capacity - min(2 * capacity, rest));
+        }
+        return e;
+    }
+};
+
+// S3-FIFO (Yang et al.): new keys enter a small FIFO holding a tenth of
+// the bytes and are dropped from it unless hit there, so one-off objects
+// never reach the main FIFO. Survivors and keys still remembered by the
+// ghost queue go to the main FIFO, where a hit buys one more pass.
+class S3FifoPolicy : public EvictionPolicy {
+private:
+    enum { SMALL, MAIN };
+    EntryQueue queues[2];
+    GhostQueue ghost;
+    size_t small_capacity, main_capacity;
+
+public:
+    S3FifoPolicy(size_t cap) : small_capacity(cap / 10), main_capacity(cap - cap / 10) {}
+    const char* name() const override { return "s3fifo"; }
+
+    void insert(CacheEntry* e) override {
+        uint8_t to = ghost.erase(e->hash) ? MAIN : SMALL;
+        queues[to].push(e, to);
+    }
+    void erase(CacheEntry* e) override { queues[e->queue].erase(e); }
+
+    CacheEntry* evict() override {
+        for (;;) {
+            if (queues[SMALL].bytes > small_capacity || queues[MAIN].items.empty()) {
+                CacheEntry* e = queues[SMALL].oldest();
+                if (!e) return nullptr;
+                queues[SMALL].erase(e);
+                if (e->freq.load(memory_order_relaxed) > 0) {
+                    e->freq.store(0, memory_order_relaxed);
+                    queues[MAIN].push(e, MAIN);
+                    continue;
+                }
+                ghost.push(e->hash, e->charge, main_capacity);
+                return e;
+            }
+            CacheEntry* e = queues[MAIN].oldest();
+            queues[MAIN].erase(e);
+            uint8_t freq = e->freq.load(memory_order_relaxed);
+            if (freq > 0) {
+                e->freq.store(freq - 1, memory_order_relaxed);
+                queues[MAIN].push(e, MAIN);
+                continue;
+            }
+            return e;
+        }
+    }
+};
+
+// Count-min sketch of how often key hashes were seen, in counters that
+// saturate at 15 and are all halved every ten adds per counter, so that
+// popularity fades.
+class FrequencySketch {
+private:
+    static const size_t WIDTH = 1 << 13; // counters per row
+    static const size_t ROWS = 4;
+    vector<uint8_t> counters;
+    size_t additions = 0;
+
+    static size_t slot(size_t hash, size_t row) {
+        uint64_t h = (hash + row * 0x9e3779b97f4a7c15ULL) * 0xff51afd7ed558ccdULL;
+        return row * WIDTH + ((h >> 40) & (WIDTH - 1));
+    }
+
+public:
+    FrequencySketch() : counters(WIDTH * ROWS, 0) {}
+
+    void add(size_t hash) {
+        bool grew = false;
+        for (size_t r = 0; r < ROWS; r++) {
+            uint8_t& c = counters[slot(hash, r)];
+            if (c < 15) {
+                c++;
+                grew = true;
+            }
+        }
+        if (grew && ++additions >= 10 * WIDTH) {
+            for (uint8_t& c : counters) c >>= 1;
+            additions /= 2;
+        }
+    }
+
+    unsigned estimate(size_t hash) const {
+        unsigned n = 15;
+        for (size_t r = 0; r < ROWS; r++) n = min<unsigned>(n, counters[slot(hash, r)]);
+        return n;
+    }
+};
+
+// W-TinyLFU (Einziger et al.): new entries pass through an LRU window of
+// 1% of the bytes; leaving it, an entry displaces the main cache's
+// eviction candidate only if the frequency sketch has seen it more often.
+// The main cache is a segmented LRU, 80% of it protected for entries hit
+// while on probation.
+class TinyLfuPolicy : public EvictionPolicy {
+private:
+    enum { WINDOW, PROBATION, PROTECTED };
+    EntryQueue queues[3];
+    FrequencySketch sketch;
+    size_t window_capacity, main_capacity, protected_capacity;
+
+    CacheEntry* main_victim() const {
+        CacheEntry* e = queues[PROBATION].oldest();
+        return e ? e : queues[PROTECTED].oldest();
+    }
+
+public:
+    TinyLfuPolicy(size_t cap)
+        : window_capacity(cap / 100), main_capacity(cap - cap / 100), protected_capacity(main_capacity / 10 * 8) {}
+    const char* name() const override { return "tinylfu"; }
+    bool ordered() const override { return true; }
+
+    void hit(CacheEntry* e) override {
+        sketch.add(e->hash);
+        if (e->queue != PROBATION) {
+            queues[e->queue].touch(e);
+            return;
+        }
+        queues[PROBATION].erase(e);
+        queues[PROTECTED].push(e, PROTECTED);
+        while (queues[PROTECTED].bytes > protected_capacity) {
+            CacheEntry* demoted = queues[PROTECTED].oldest();
+            queues[PROTECTED].erase(demoted);
+            queues[PROBATION].push(demoted, PROBATION);
+        }
+    }
+
+    void miss(size_t hash) override { sketch.add(hash); }
+    void insert(CacheEntry* e) override { queues[WINDOW].push(e, WINDOW); }
+    void erase(CacheEntry* e) override { queues[e->queue].erase(e); }
+
+    CacheEntry* evict() override {
+        while (queues[WINDOW].bytes > window_capacity) {
+            CacheEntry* candidate = queues[WINDOW].oldest();
+            queues[WINDOW].erase(candidate);
+            CacheEntry* victim = main_victim();
+            if (!victim || queues[PROBATION].bytes + queues[PROTECTED].bytes + candidate->charge <= main_capacity) {
+                queues[PROBATION].push(candidate, PROBATION);
+                continue;
+            }
+            if (sketch.estimate(candidate->hash) <= sketch.estimate(victim->hash)) return candidate;
+            queues[victim->queue].erase(victim);
+            queues[PROBATION].push(candidate, PROBATION);
+            return victim;
+        }
+        CacheEntry* e = main_victim();
+        if (!e) e = queues[WINDOW].oldest();
+        if (e) queues[e->queue].erase(e);
+        return e;
+    }
+};
+
+// Null for an unknown policy name.
+EvictionPolicy* createEvictionPolicy(const string& name, size_t capacity) {
+    if (name == "lru") return new LruPolicy();
+    if (name == "clock") return new ClockPolicy();
+    if (name == "arc") return new ArcPolicy(capacity);
+    if (name == "s3fifo") return new S3FifoPolicy(capacity);
+    if (name == "tinylfu") return new TinyLfuPolicy(capacity);
+    return nullptr;
+}
+
+// Remembers the key hashes of roughly the last window misses in two Bloom
+// filters: new keys go into the current one, which replaces the previous
+// one once it has taken window keys. A key counts as seen if either holds
+// it, so a key is remembered for between one and two windows.
+class Doorkeeper {
+private:
+    static const int PROBES = 7; // about 1% false positives at 10 bits per key
+    vector<uint64_t> filters[2];
+    size_t mask = 0; // bits per filter, less one
+    size_t added = 0, window = 0;
+    int current = 0;
+
+    static bool test(const vector<uint64_t>& f, size_t bit) { return f[bit >> 6] >> (bit & 63) & 1; }
+
+public:
+    // 0 disables the filter; seen() then always says yes.
+    void set_window(size_t n) {
+        window = n;
+        size_t bits = 64;
+        while (bits < n * 10) bits <<= 1;
+        mask = bits - 1;
+        for (vector<uint64_t>& f : filters) f.assign(n ? bits / 64 : 0, 0);
+        added = 0;
+    }
+
+    // Whether hash was seen within the window; remembers it either way.
+    bool seen(size_t hash) {
+        if (!window) return true;
+        size_t h2 = (hash * 0x9e3779b97f4a7c15ULL) | 1;
+        bool in_current = true, in_previous = true;
+        for (int i = 0; i < PROBES; i++) {
+            size_t bit = (hash + i * h2) & mask;
+            in_current = in_current && test(filters[current], bit);
+            in_previous = in_previous && test(filters[!current], bit);
+        }
+        if (in_current) return true;
+        if (added++ == window) {
+            current = !current;
+            fill(filters[current].begin(), filters[current].end(), 0);
+            added = 1;
+        }
+        for (int i = 0; i < PROBES; i++) {
+            size_t bit = (hash + i * h2) & mask;
+            filters[current][bit >> 6] |= 1ULL << (bit & 63);
+        }
+        return in_previous;
+    }
+};
+
+// Split into a power-of-two number of shards, picked by key hash, each
+// with its own lock, index, eviction policy, admission filter and share
+// of the byte budget. Lookups take no lock at all: each shard's index is
+// a chained hash table that writers change under the shard lock and
+// readers walk under an Epoch guard. A key's responses that differ by
+// Vary hang off its one index link as a chain of up to MAX_VARIANTS
+// variants, oldest first. A hit bumps its entry's freq, and
+// reports the hit to the policy only if the policy orders hits and the
+// lock is free. A fetched body is only stored if its key already missed
+// once within the admission window, so objects requested once never
+// displace anything.
+class LRUCache {
+public:
+    // A request's values for the given header names (see varySelector).
+    typedef function<string(const vector<string>&)> VarySelect;
+
+private:
+    // Index chains link to entries rather than through them, so a table
+    // can be rebuilt without touching what readers are walking. entry is
+    // the first of the key's variants.
+    struct Link {
+        atomic<CacheEntry*> entry;
+        atomic<Link*> next{nullptr};
+    };
+
+    struct Table {
+        size_t mask;
+        unique_ptr<atomic<Link*>[]> buckets;
+
+        Table(size_t n) : mask(n - 1), buckets(new atomic<Link*>[n]) {
+            for (size_t i = 0; i < n; i++) buckets[i].store(nullptr, memory_order_relaxed);
+        }
+        ~Table() {
+            for (size_t i = 0; i <= mask; i++) {
+                for (Link* l = buckets[i].load(memory_order_relaxed); l; ) {
+                    Link* next = l->next.load(memory_order_relaxed);
+                    delete l;
+                    l = next;
+                }
+            }
+        }
+    };
+
+    static const size_t MIN_BUCKETS = 256; // per shard; doubles when keys outnumber buckets
+
+    struct Shard {
+        mutex lock; // writers only
+        size_t capacity_bytes = 0;
+        size_t current_size = 0;
+        size_t count = 0; // entries, variants included
+        size_t keys = 0;  // index links
+        atomic<Table*> table{nullptr};
+        unique_ptr<EvictionPolicy> policy;
+        Doorkeeper doorkeeper;
+        unordered_map<string, shared_ptr<Fetch>> fetches; // misses being fetched, by key
+        vector<shared_ptr<const CacheBody>> released;     // unlinked bodies, dropped once the lock is let go
+        atomic<uint64_t> locks{0}, contended{0};          // acquisitions, and those that had to wait
+        atomic<uint64_t> hits{0}, misses{0}, unordered{0}; // lookups; hits the policy missed for a busy lock
+
+        ~Shard() {
+            Table* t = table.load(memory_order_relaxed);
+            for (size_t i = 0; i <= t->mask; i++) {
+                for (Link* l = t->buckets[i].load(memory_order_relaxed); l; l = l->next.load(memory_order_relaxed)) {
+                    for (CacheEntry* e = l->entry.load(memory_order_relaxed); e; ) {
+                        CacheEntry* next = e->next_variant.load(memory_order_relaxed);
+                        delete e;
+                        e = next;
+                    }
+                }
+            }
+            delete t;
+        }
+    };
+
+    size_t capacity_bytes;
+    size_t max_object_size; // largest body admitted
+    string policy_name;
+    size_t admission_window; // misses the doorkeeper remembers per shard; 0 admits all
+    bool memfd_storage;
+    atomic<uint64_t> stored, oversize, rejected;
+    unique_ptr<Shard[]> shards;
+    size_t shard_mask;
+
+    // Copies data into a sealed memfd; -1 if that fails.
+    static int storeMemfd(const string& data) {
+        int fd = memfd_create("proxy-cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) return -1;
+        size_t off = 0;
+        while (off < data.size()) {
+            ssize_t n = write(fd, data.data() + off, data.size() - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                close(fd);
+                return -1;
+            }
+            off += n;
+        }
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        return fd;
+    }
+
+    Shard& shard(size_t h) { return shards[(h ^ (h >> 29)) & shard_mask]; }
+
+    // Takes a shard's lock, counting the times it was already held.
+    static unique_lock<mutex> acquire(Shard& sh) {
+        unique_lock<mutex> lock(sh.lock, try_to_lock);
+        sh.locks.fetch_add(1, memory_order_relaxed);
+        if (!lock.owns_lock()) {
+            sh.contended.fetch_add(1, memory_order_relaxed);
+            lock.lock();
+        }
+        return lock;
+    }
+
+    // Lock-free; the caller holds an Epoch guard or the shard lock.
+    static Link* find(Shard& sh, const string& url, size_t h) {
+        Table* t = sh.table.load(memory_order_acquire);
+        for (Link* l = t->buckets[h & t->mask].load(memory_order_acquire); l; l = l->next.load(memory_order_acquire)) {
+            CacheEntry* e = l->entry.load(memory_order_acquire);
+            if (e->hash == h && e->url == url) return l;
+        }
+        return nullptr;
+    }
+
+    // Lock-free like find(): the variant of l's key that a request whose
+    // values for a list of header names select() gives would get, with its
+    // body in found; null if there is none.
+    static CacheEntry* variant(Link* l, const VarySelect& select, shared_ptr<const CacheBody>& found) {
+        shared_ptr<const CacheBody> named; // whose vary names selector is for
+        string selector;
+        for (CacheEntry* e = l->entry.load(memory_order_acquire); e; e = e->next_variant.load(memory_order_acquire)) {
+            shared_ptr<const CacheBody> body = e->body.load(memory_order_acquire);
+            if (!body) continue; // unlinked while we looked
+            if (!body->vary.empty()) {
+                if (!named || named->vary != body->vary) {
+                    selector = select(body->vary);
+                    named = body;
+                }
+                if (selector != body->selector) continue;
+            }
+            found = move(body);
+            return e;
+        }
+        return nullptr;
+    }
+
+    // Under the shard lock: adds a link for e's key.
+    static void link(Table* t, CacheEntry* e) {
+        atomic<Link*>& head = t->buckets[e->hash & t->mask];
+        Link* l = new Link();
+        l->entry.store(e, memory_order_relaxed);
+        l->next.store(head.load(memory_order_relaxed), memory_order_relaxed);
+        head.store(l, memory_order_release);
+    }
+
+    // Under the shard lock: doubles the table once keys outnumber its
+    // buckets. The new table gets fresh links; the old one is retired.
+    static void grow(Shard& sh) {
+        Table* old = sh.table.load(memory_order_relaxed);
+        if (sh.keys <= old->mask + 1) return;
+        Table* t = new Table((old->mask + 1) * 2);
+        for (size_t i = 0; i <= old->mask; i++) {
+            for (Link* l = old->buckets[i].load(memory_order_relaxed); l; l = l->next.load(memory_order_relaxed)) {
+                link(t, l->entry.load(memory_order_relaxed));
+            }
+        }
+        sh.table.store(t, memory_order_release);
+        Epoch::retire([old]() { delete old; });
+    }
+
+    // Under the shard lock: publishes e to readers, after any variants its
+    // key already has.
+    static void publish(Shard& sh, CacheEntry* e) {
+        Link* l = find(sh, e->url, e->hash);
+        if (l) {
+            CacheEntry* last = l->entry.load(memory_order_relaxed);
+            while (CacheEntry* next = last->next_variant.load(memory_order_relaxed)) last = next;
+            last->next_variant.store(e, memory_order_release);
+        } else {
+            link(sh.table.load(memory_order_relaxed), e);
+            sh.keys++;
+            grow(sh);
+        }
+        e->resident = true;
+        sh.current_size += e->charge;
+        sh.count++;
+    }
+
+    // Under the shard lock: unlinks e, already out of its policy, and frees
+    // it once no reader can hold it. Its key's link goes with its last
+    // variant. The body is let go at once rather than with the entry, so
+    // it outlives eviction only in the hands of requests still sending it;
+    // it is dropped after the shard lock is released (see released).
+    static void unlink(Shard& sh, CacheEntry* e) {
+        Table* t = sh.table.load(memory_order_relaxed);
+        atomic<Link*>* prev = &t->buckets[e->hash & t->mask];
+        Link* l = prev->load(memory_order_relaxed);
+        while (l->entry.load(memory_order_relaxed)->hash != e->hash || l->entry.load(memory_order_relaxed)->url != e->url) {
+            prev = &l->next;
+            l = l->next.load(memory_order_relaxed);
+        }
+        // Whatever is unlinked keeps its next pointer for readers on it
+        CacheEntry* next = e->next_variant.load(memory_order_relaxed);
+        CacheEntry* first = l->entry.load(memory_order_relaxed);
+        Link* dead = nullptr;
+        if (first != e) {
+            while (first->next_variant.load(memory_order_relaxed) != e) first = first->next_variant.load(memory_order_relaxed);
+            first->next_variant.store(next, memory_order_release);
+        } else if (next) {
+            l->entry.store(next, memory_order_release);
+        } else {
+            prev->store(l->next.load(memory_order_relaxed), memory_order_release);
+            dead = l;
+            sh.keys--;
+        }
+        e->resident = false;
+        sh.released.push_back(e->body.exchange(nullptr, memory_order_relaxed));
+        sh.current_size -= e->charge;
+        sh.count--;
+        Epoch::retire([dead, e]() {
+            delete dead;
+            delete e;
+        });
+    }
+
+    // Under the shard lock: takes e out of its policy and the index.
+    static void remove(Shard& sh, CacheEntry* e) {
+        sh.policy->erase(e);
+        unlink(sh, e);
+    }
+
+    // Under the shard lock: drops the variants a new entry e replaces (the
+    // same selection, or either side not varying at all), then the oldest
+    // others until e fits within MAX_VARIANTS.
+    static void supersede(Shard& sh, const CacheEntry* e) {
+        Link* l = find(sh, e->url, e->hash);
+        if (!l) return;
+        vector<CacheEntry*> kept, dropped;
+        shared_ptr<const CacheBody> body = e->body.load(memory_order_relaxed);
+        for (CacheEntry* v = l->entry.load(memory_order_relaxed); v; v = v->next_variant.load(memory_order_relaxed)) {
+            shared_ptr<const CacheBody> old = v->body.load(memory_order_relaxed);
+            bool same = old->vary.empty() || body->vary.empty()
+                || (old->vary == body->vary && old->selector == body->selector);
+            (same ? dropped : kept).push_back(v);
+        }
+        for (size_t i = 0; kept.size() - i >= MAX_VARIANTS; i++) dropped.push_back(kept[i]);
+        for (CacheEntry* v : dropped) remove(sh, v);
+    }
+
+    // Under the shard lock: frees space for need more bytes in the order
+    // the policy picks.
+    static void evict(Shard& sh, size_t need) {
+        while (sh.current_size + need > sh.capacity_bytes) {
+            CacheEntry* e = sh.policy->evict();
+            if (!e) break;
+            unlink(sh, e);
+        }
+    }
+
+public:
+    LRUCache(size_t cap) : capacity_bytes(cap), max_object_size(MAX_ELEMENT_SIZE), policy_name(EVICTION_POLICY),
+                           admission_window(ADMISSION_WINDOW), memfd_storage(false), stored(0), oversize(0), rejected(0) {
+        set_shards(CACHE_SHARDS);
+    }
+
+    // Rounds n up to a power of two and splits the budget evenly; only
+    // before the cache is first used.
+    void set_shards(size_t n) {
+        size_t count = 1;
+        while (count < n && count < 256) count <<= 1;
+        shards.reset(new Shard[count]);
+        shard_mask = count - 1;
+        for (size_t i = 0; i < count; i++) {
+            shards[i].capacity_bytes = capacity_bytes / count;
+            shards[i].table.store(new Table(MIN_BUCKETS), memory_order_relaxed);
+            shards[i].policy.reset(createEvictionPolicy(policy_name, shards[i].capacity_bytes));
+            shards[i].doorkeeper.set_window(admission_window);
+        }
+        set_max_object(max_object_size);
+    }
+
+    // Misses each shard remembers for admission; 0 stores every response.
+    // Only before the cache is first used.
+    void set_admission_window(size_t n) {
+        admission_window = n;
+        for (size_t i = 0; i <= shard_mask; i++) shards[i].doorkeeper.set_window(n);
+    }
+
+    // Selects the eviction policy by name; false, changing nothing, if
+    // there is no such policy. Only before the cache is first used.
+    bool set_policy(const string& name) {
+        EvictionPolicy* probe = createEvictionPolicy(name, 0);
+        if (!probe) return false;
+        delete probe;
+        policy_name = name;
+        for (size_t i = 0; i <= shard_mask; i++) {
+            shards[i].policy.reset(createEvictionPolicy(name, shards[i].capacity_bytes));
+        }
+        return true;
+    }
+
+    // Keep bodies of at least MEMFD_MIN_SIZE in memfds so hits can be sent
+    // with sendfile() straight from the page cache.
+    void set_memfd_storage(bool on) { memfd_storage = on; }
+
+    // Bodies larger than this are never buffered for the cache; it cannot
+    // exceed a shard's budget.
+    void set_max_object(size_t n) { max_object_size = min(n, shards[0].capacity_bytes); }
+    size_t max_object() const { return max_object_size; }
+
+    // A response was passed through uncached for being too large.
+    void count_oversize() { oversize.fetch_add(1, memory_order_relaxed); }
+
+    void report(FILE* out) {
+        size_t count = shard_mask + 1, n = 0, bytes = 0;
+        uint64_t locks = 0, contended = 0, hits = 0, misses = 0, unordered = 0;
+        vector<pair<size_t, size_t>> per_shard;
+        for (size_t i = 0; i < count; i++) {
+            Shard& sh = shards[i];
+            {
+                lock_guard<mutex> lock(sh.lock);
+                per_shard.push_back({sh.count, sh.current_size});
+            }
+            n += per_shard.back().first;
+            bytes += per_shard.back().second;
+            locks += sh.locks.load(memory_order_relaxed);
+            contended += sh.contended.load(memory_order_relaxed);
+            hits += sh.hits.load(memory_order_relaxed);
+            misses += sh.misses.load(memory_order_relaxed);
+            unordered += sh.unordered.load(memory_order_relaxed);
+        }
+        fprintf(out, "Cache: %zu objects, %zu of %zu bytes, %llu stored, %llu too large (over %zu bytes)\n", n, bytes,
+                capacity_bytes, (unsigned long long)stored.load(), (unsigned long long)oversize.load(), max_object_size);
+        fprintf(out, "  %s eviction: %llu hits, %llu misses, hit ratio %.2f%%", policy_name.c_str(),
+                (unsigned long long)hits, (unsigned long long)misses,
+                hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+        if (shards[0].policy->ordered()) {
+            fprintf(out, ", %llu hits unseen by the policy (lock busy)", (unsigned long long)unordered);
+        }
+        if (admission_window) {
+            fprintf(out, "\n  admission: %llu first sightings not stored (window %zu misses per shard)",
+                    (unsigned long long)rejected.load(), admission_window);
+        }
+        fprintf(out, "\n  %zu shards, %llu of %llu lock acquisitions contended\n", count, (unsigned long long)contended,
+                (unsigned long long)locks);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(out, "  shard %-3zu %zu objects, %zu bytes, %llu locks, %llu contended\n", i, per_shard[i].first,
+                    per_shard[i].second, (unsigned long long)shards[i].locks.load(memory_order_relaxed),
+                    (unsigned long long)shards[i].contended.load(memory_order_relaxed));
+        }
+        fflush(out);
+    }
+
+    // A hit, or null with fetch set to the miss in flight for url: a new
+    // one the caller must fetch if leader is set, else one to follow. A
+    // stored variant only matches if select() gives the values it was
+    // stored for. Hits wait on no lock; a miss locks its shard to join or
+    // start a fetch.
+    shared_ptr<const CacheBody> get(const CacheKey& key, const VarySelect& select, shared_ptr<Fetch>& fetch,
+                                    bool& leader) {
+        const string& url = key.text;
+        size_t h = key.hash;
+        Shard& sh = shard(h);
+        {
+            Epoch::Guard guard;
+            Link* l = find(sh, url, h);
+            shared_ptr<const CacheBody> body;
+            CacheEntry* e = l ? variant(l, select, body) : nullptr;
+            if (e) {
+                sh.hits.fetch_add(1, memory_order_relaxed);
+                uint8_t freq = e->freq.load(memory_order_relaxed);
+                if (freq < 3) e->freq.store(freq + 1, memory_order_relaxed);
+                if (sh.policy->ordered()) {
+                    unique_lock<mutex> lock(sh.lock, try_to_lock);
+                    if (!lock.owns_lock()) {
+                        sh.unordered.fetch_add(1, memory_order_relaxed);
+                    } else if (e->resident) {
+                        sh.policy->hit(e);
+                    }
+                }
+                return body;
+            }
+        }
+
+        unique_lock<mutex> lock = acquire(sh);
+        Link* l = find(sh, url, h); // stored since the lock-free look
+        shared_ptr<const CacheBody> body;
+        if (l && variant(l, select, body)) {
+            sh.hits.fetch_add(1, memory_order_relaxed);
+            return body;
+        }
+        sh.misses.fetch_add(1, memory_order_relaxed);
+        sh.policy->miss(h);
+        bool seen = sh.doorkeeper.seen(h);
+        auto f = sh.fetches.find(url);
+        leader = f == sh.fetches.end();
+        if (leader) {
+            f = sh.fetches.emplace(url, make_shared<Fetch>()).first;
+            f->second->admit.store(seen, memory_order_relaxed);
+        } else {
+            f->second->admit.store(true, memory_order_relaxed); // asked for twice already
+        }
+        fetch = f->second;
+        return nullptr;
+    }
+
+    // Ends the leader's fetch of key and releases its followers. A DONE
+    // body is stored; the other outcomes leave the cache as it was.
+    void end_fetch(const CacheKey& key, const shared_ptr<Fetch>& fetch, Fetch::State state, int status = 0) {
+        const string& url = key.text;
+        size_t h = key.hash;
+        Shard& sh = shard(h);
+        shared_ptr<CacheBody> body = fetch->body;
+        size_t entry_size = url.size() + body->size;
+        bool store = state == Fetch::DONE && entry_size <= sh.capacity_bytes;
+        if (store && !fetch->admit.load(memory_order_relaxed)) {
+            rejected.fetch_add(1, memory_order_relaxed);
+            store = false;
+        }
+
+        // Followers keep reading the heap copy; the cache gets its own
+        // memfd, built outside the lock.
+        if (store && memfd_storage && body->size >= MEMFD_MIN_SIZE) {
+            shared_ptr<CacheBody> copy = make_shared<CacheBody>();
+            copy->fd = storeMemfd(body->data);
+            if (copy->fd >= 0) {
+                copy->size = body->size;
+                copy->head_len = body->head_len;
+                copy->framed = body->framed;
+                copy->vary = body->vary;
+                copy->selector = body->selector;
+                body = copy;
+            }
+        }
+
+        CacheEntry* e = NULL;
+        if (store) {
+            e = new CacheEntry();
+            e->url = url;
+            e->hash = h;
+            e->charge = entry_size;
+            e->body.store(move(body), memory_order_relaxed);
+        }
+
+        vector<shared_ptr<const CacheBody>> released; // freed here, outside the lock
+        {
+            unique_lock<mutex> lock = acquire(sh);
+            auto f = sh.fetches.find(url);
+            if (f != sh.fetches.end() && f->second == fetch) sh.fetches.erase(f);
+
+            if (e) {
+                supersede(sh, e);
+                evict(sh, entry_size);
+                sh.policy->insert(e);
+                publish(sh, e);
+                stored.fetch_add(1, memory_order_relaxed);
+            }
+            released.swap(sh.released);
+        }
+        fetch->update(state, fetch->body->data.size(), status);
+    }
+};
+
+// ----------------------------------------------------------
+//  Buffer Pools
+// ----------------------------------------------------------
+// Per-thread free lists that keep the request path off the allocator:
+// fixed-size header and relay buffers, plus string accumulators that keep
+// their capacity between requests. Anything may be returned on a different
+// thread than it was taken on (stolen tasks); it just joins that thread's
+// lists. Hit/miss counters are printed on SIGUSR1.
+class BufferPool {
+public:
+    enum SizeClass { HEADER, RELAY, STRING, NUM_CLASSES };
+
+    static size_t relay_size; // relay chunk, tunable with -r
+
+private:
+    static const size_t MAX_FREE = 256;                   // buffers per class and thread
+    static const size_t MAX_FREE_STRINGS = 64;
+    static const size_t MAX_STRING_CAPACITY = 256 * 1024; // larger accumulators are freed
+
+    static mutex registry_lock;
+    static vector<BufferPool*> registry;
+
+    vector<char*> free_bufs[STRING];
+    vector<string> free_strings;
+    // Written only by the owning thread; atomics so the stats dump can read them.
+    atomic<uint64_t> hits[NUM_CLASSES];
+    atomic<uint64_t> misses[NUM_CLASSES];
+
+    static void bump(atomic<uint64_t>& c) { c.store(c.load(memory_order_relaxed) + 1, memory_order_relaxed); }
+
+    BufferPool() {
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            hits[c].store(0, memory_order_relaxed);
+            misses[c].store(0, memory_order_relaxed);
+        }
+        lock_guard<mutex> lock(registry_lock);
+        registry.push_back(this);
+    }
+
+public:
+    // Pools live as long as the process; serving threads never exit.
+    static BufferPool& local() {
+        static thread_local BufferPool* pool = new BufferPool();
+        return *pool;
+    }
+
+    static size_t class_size(SizeClass c) { return c == HEADER ? MAX_BYTES : relay_size; }
+
+    char* get(SizeClass c) {
+        if (free_bufs[c].empty()) {
+            bump(misses[c]);
+            return new char[class_size(c)];
+        }
+        bump(hits[c]);
+        char* b = free_bufs[c].back();
+        free_bufs[c].pop_back();
+        return b;
+    }
+
+    void put(SizeClass c, char* b) {
+        if (free_bufs[c].size() < MAX_FREE) free_bufs[c].push_back(b);
+        else delete[] b;
+    }
+
+    string get_string() {
+        if (free_strings.empty()) {
+            bump(misses[STRING]);
+            return string();
+        }
+        bump(hits[STRING]);
+        string s = move(free_strings.back());
+        free_strings.pop_back();
+        return s;
+    }
+
+    void put_string(string& s) {
+        s.clear();
+        if (s.capacity() > 0 && s.capacity() <= MAX_STRING_CAPACITY && free_strings.size() < MAX_FREE_STRINGS) {
+            free_strings.push_back(move(s));
+        }
+        string().swap(s);
+    }
+
+    static void report(FILE* out) {
+        static const char* names[NUM_CLASSES] = {"header", "relay", "string"};
+        uint64_t h[NUM_CLASSES] = {0}, m[NUM_CLASSES] = {0};
+        {
+            lock_guard<mutex> lock(registry_lock);
+            for (BufferPool* p : registry) {
+                for (int c = 0; c < NUM_CLASSES; c++) {
+                    h[c] += p->hits[c].load(memory_order_relaxed);
+                    m[c] += p->misses[c].load(memory_order_relaxed);
+                }
+            }
+        }
+        fprintf(out, "Buffer pools (relay chunk %zu bytes):\n", relay_size);
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            fprintf(out, "  %-6s %llu hits, %llu misses\n", names[c], (unsigned long long)h[c], (unsigned long long)m[c]);
+        }
+        fflush(out);
+    }
+};
+
+size_t BufferPool::relay_size = MAX_BYTES;
+mutex BufferPool::registry_lock;
+vector<BufferPool*> BufferPool::registry;
+
+// A pooled buffer for the lifetime of a scope (or coroutine frame).
+class PooledBuffer {
+private:
+    BufferPool::SizeClass cls;
+    char* buf;
+
+public:
+    explicit PooledBuffer(BufferPool::SizeClass c) : cls(c), buf(BufferPool::local().get(c)) {}
+    ~PooledBuffer() { BufferPool::local().put(cls, buf); }
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* data() { return buf; }
+    size_t size() const { return BufferPool::class_size(cls); }
+};
+
+// A recycled string accumulator; moving its contents out is fine.
+class PooledString {
+private:
+    string s;
+
+public:
+    PooledString() : s(BufferPool::local().get_string()) {}
+    ~PooledString() { BufferPool::local().put_string(s); }
+    PooledString(const PooledString&) = delete;
+    PooledString& operator=(const PooledString&) = delete;
+
+    string& str() { return s; }
+};
+
+// ----------------------------------------------------------
+//  Event Loop
+// ----------------------------------------------------------
+// Operations are submitted per fd and complete through IoHandler::on_io()
+// with the syscall result (bytes, new fd, 0) or -errno. At most one read-side
+// (accept/recv/splice in) and one write-side (send/sendv/connect/splice
+// out/sendfile) operation may be pending on an fd. Completions are never delivered from inside the submitting call.
+struct IoHandler {
+    virtual void on_io(int tag, ssize_t result) = 0;
+    virtual ~IoHandler() {}
+};
+
+class EventLoop {
+protected:
+    int wakefd;
+    mutex post_lock;
+    vector<function<void()>> posted;
+    atomic<bool> notified;
+
+    void run_posted() {
+        uint64_t n;
+        while (read(wakefd, &n, sizeof(n)) > 0) {}
+        vector<function<void()>> batch;
+        {
+            lock_guard<mutex> lock(post_lock);
+            batch.swap(posted);
+        }
+        for (auto& fn : batch) fn();
+        if (notified.exchange(false, memory_order_acq_rel) && on_notify) on_notify();
+    }
+
+    // Fires due timers; returns ms until the next one, or -1 if none are left.
+    int run_timers() {
+        if (timers.empty()) return -1;
+        uint64_t now = now_ms();
+        while (!timers.empty() && timers.begin()->first.first <= now) {
+            pair<IoHandler*, int> t = timers.begin()->second;
+            timers.erase(timers.begin());
+            t.first->on_io(t.second, -ETIME);
+        }
+        return timers.empty() ? -1 : (int)(timers.begin()->first.first - now);
+    }
+
+    // Runs deferred work before the loop would block; true means more is queued.
+    bool run_deferred() {
+        current = this;
+        return run_tasks && run_tasks();
+    }
+
+public:
+    typedef pair<uint64_t, uint64_t> TimerId; // (deadline ms, sequence)
+
+private:
+    map<TimerId, pair<IoHandler*, int>> timers;
+    uint64_t timer_seq = 0;
+
+public:
+    static thread_local EventLoop* current; // loop running on this thread, if any
+
+    static uint64_t now_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    int sock_flags; // extra socket()/accept4() flags the backend expects
+    function<void()> on_notify; // run on the loop thread after notify()
+    function<bool()> run_tasks; // see run_deferred()
+
+    EventLoop() : notified(false), sock_flags(0) {
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakefd < 0) {
+            perror("Event loop setup failed");
+            exit(1);
+        }
+    }
+    virtual ~EventLoop() {}
+
+    virtual void accept(int fd, IoHandler* h, int tag) = 0;
+    virtual void recv(int fd, char* buf, size_t len, IoHandler* h, int tag) = 0;
+    virtual void send(int fd, const char* buf, size_t len, IoHandler* h, int tag) = 0;
+    // Gathering send; iov must stay valid until the op completes.
+    virtual void sendv(int fd, const struct iovec* iov, int iovcnt, IoHandler* h, int tag) = 0;
+    // Completes with 0 once connected.
+    virtual void connect(int fd, const struct sockaddr* addr, socklen_t addrlen, IoHandler* h, int tag) = 0;
+    // Moves up to len bytes between socket fd and a blocking pipe without a
+    // user-space copy: fd -> pipe_fd is a read-side op, pipe_fd -> fd
+    // (to_sock) a write-side op.
+    virtual void splice(int fd, int pipe_fd, size_t len, bool to_sock, IoHandler* h, int tag) = 0;
+    // Sends up to len bytes of file_fd starting at off; a write-side op on fd.
+    virtual void sendfile(int fd, int file_fd, off_t off, size_t len, IoHandler* h, int tag) = 0;
+    // Drops any pending operations on fd (their handlers are not called) and closes it.
+    virtual void close(int fd) = 0;
+    // True if input for fd (bytes or EOF) has already left the socket and
+    // waits for the next recv, out of reach of a MSG_PEEK.
+    virtual bool holds_input(int) { return false; }
+    virtual void run() = 0;
+
+    // Loop thread only: calls h->on_io(tag, -ETIME) after ms milliseconds
+    // unless cancelled first.
+    TimerId add_timer(uint64_t ms, IoHandler* h, int tag) {
+        TimerId id(now_ms() + ms, timer_seq++);
+        timers[id] = make_pair(h, tag);
+        return id;
+    }
+
+    void cancel_timer(TimerId id) { timers.erase(id); }
+
+    // Thread-safe, allocation-free wakeup that runs on_notify; repeated
+    // notifications before the loop wakes collapse into one.
+    void notify() {
+        if (notified.exchange(true, memory_order_acq_rel)) return;
+        uint64_t one = 1;
+        ssize_t r = write(wakefd, &one, sizeof(one));
+        (void)r;
+    }
+
+    // Thread-safe: runs fn on the loop thread.
+    void post(function<void()> fn) {
+        {
+            lock_guard<mutex> lock(post_lock);
+            posted.push_back(move(fn));
+        }
+        uint64_t one = 1;
+        ssize_t r = write(wakefd, &one, sizeof(one));
+        (void)r;
+    }
+};
+
+// ----------------------------------------------------------
+//  Epoll Backend (edge-triggered)
+// ----------------------------------------------------------
+class EpollLoop : public EventLoop {
+private:
+    enum OpKind { OP_NONE, OP_ACCEPT, OP_RECV, OP_SEND, OP_SENDV, OP_CONNECT, OP_SPLICE_IN, OP_SPLICE_OUT, OP_SENDFILE };
+
+    struct PendingOp {
+        OpKind kind = OP_NONE;
+        IoHandler* handler = nullptr;
+        int tag = 0;
+        char* buf = nullptr; // or the iovec array for OP_SENDV
+        size_t len = 0;      // or the iovec count
+        int aux_fd = -1;   // pipe (splice) or file (sendfile)
+        off_t off = 0;
+        bool done = false;
+        ssize_t result = 0;
+    };
+
+    struct FdState {
+        uint32_t gen = 0;
+        bool registered = false;
+        PendingOp rd, wr;
+    };
+
+    struct ReadyOp {
+        int fd;
+        uint32_t gen;
+        bool write_side;
+    };
+
+    int epfd;
+    vector<FdState> fds;
+    vector<ReadyOp> ready;
+
+    FdState& state(int fd) {
+        if ((size_t)fd >= fds.size()) fds.resize(max((size_t)fd + 1, fds.size() * 2));
+        return fds[fd];
+    }
+
+    void watch(int fd) {
+        FdState& st = state(fd);
+        if (st.registered) return;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = ((uint64_t)st.gen << 32) | (uint32_t)fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) st.registered = true;
+    }
+
+    // Runs the syscall for a pending op. Returns false if it would block.
+    bool attempt(int fd, PendingOp& op) {
+        ssize_t res = 0;
+        switch (op.kind) {
+            case OP_ACCEPT:
+                res = ::accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                break;
+            case OP_RECV:
+                res = ::recv(fd, op.buf, op.len, 0);
+                break;
+            case OP_SEND:
+                res = ::send(fd, op.buf, op.len, MSG_NOSIGNAL);
+                break;
+            case OP_SENDV: {
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = (struct iovec*)op.buf;
+                msg.msg_iovlen = op.len;
+                res = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+                break;
+            }
+            case OP_SPLICE_IN:
+                res = ::splice(fd, NULL, op.aux_fd, NULL, op.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                break;
+            case OP_SPLICE_OUT:
+                res = ::splice(op.aux_fd, NULL, fd, NULL, op.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                break;
+            case OP_SENDFILE:
+                res = ::sendfile(fd, op.aux_fd, &op.off, op.len);
+                break;
+            case OP_CONNECT: {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+                if (err == EINPROGRESS || err == EALREADY) return false;
+                // SO_ERROR also reads 0 while the handshake is still running.
+                if (err == 0) {
+                    struct sockaddr_storage peer;
+                    socklen_t plen = sizeof(peer);
+                    if (getpeername(fd, (struct sockaddr*)&peer, &plen) < 0 && errno == ENOTCONN) return false;
+                }
+                op.done = true;
+                op.result = -err;
+                return true;
+            }
+            default:
+                return false;
+        }
+        if (res < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if (errno == EINTR) return attempt(fd, op);
+            res = -errno;
+        }
+        op.done = true;
+        op.result = res;
+        return true;
+    }
+
+    void submit(int fd, bool write_side, OpKind kind, char* buf, size_t len, IoHandler* h, int tag,
+                int aux_fd = -1, off_t off = 0) {
+        watch(fd);
+        FdState& st = state(fd);
+        PendingOp& op = write_side ? st.wr : st.rd;
+        op.kind = kind;
+        op.handler = h;
+        op.tag = tag;
+        op.buf = buf;
+        op.len = len;
+        op.aux_fd = aux_fd;
+        op.off = off;
+        op.done = false;
+        // Edge-triggered: the readiness edge may already have been consumed,
+        // so always try the syscall once before waiting for the next edge.
+        if (attempt(fd, op)) ready.push_back({fd, st.gen, write_side});
+    }
+
+    void complete(int fd, bool write_side) {
+        FdState& st = fds[fd];
+        PendingOp& op = write_side ? st.wr : st.rd;
+        if (op.kind == OP_NONE || !op.done) return;
+        IoHandler* h = op.handler;
+        int tag = op.tag;
+        ssize_t res = op.result;
+        op = PendingOp();
+        h->on_io(tag, res); // may submit, close or delete; no references held
+    }
+
+    void run_ready() {
+        while (!ready.empty()) {
+            vector<ReadyOp> batch;
+            batch.swap(ready);
+            for (const ReadyOp& r : batch) {
+                if ((size_t)r.fd < fds.size() && fds[r.fd].gen == r.gen) complete(r.fd, r.write_side);
+            }
+        }
+    }
+
+public:
+    EpollLoop() {
+        sock_flags = SOCK_NONBLOCK;
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            perror("Event loop setup failed");
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = UINT64_MAX;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+        fds.resize(1024);
+    }
+
+    void accept(int fd, IoHandler* h, int tag) override { submit(fd, false, OP_ACCEPT, NULL, 0, h, tag); }
+    void recv(int fd, char* buf, size_t len, IoHandler* h, int tag) override { submit(fd, false, OP_RECV, buf, len, h, tag); }
+    void send(int fd, const char* buf, size_t len, IoHandler* h, int tag) override { submit(fd, true, OP_SEND, (char*)buf, len, h, tag); }
+    void sendv(int fd, const struct iovec* iov, int iovcnt, IoHandler* h, int tag) override {
+        submit(fd, true, OP_SENDV, (char*)iov, iovcnt, h, tag);
+    }
+    void splice(int fd, int pipe_fd, size_t len, bool to_sock, IoHandler* h, int tag) override {
+        submit(fd, to_sock, to_sock ? OP_SPLICE_OUT : OP_SPLICE_IN, NULL, len, h, tag, pipe_fd);
+    }
+    void sendfile(int fd, int file_fd, off_t off, size_t len, IoHandler* h, int tag) override {
+        submit(fd, true, OP_SENDFILE, NULL, len, h, tag, file_fd, off);
+    }
+
+    // fd must be a non-blocking socket.
+    void connect(int fd, const struct sockaddr* addr, socklen_t addrlen, IoHandler* h, int tag) override {
+        int r = ::connect(fd, addr, addrlen);
+        if (r == 0 || errno != EINPROGRESS) {
+            int err = (r == 0) ? 0 : errno;
+            watch(fd);
+            FdState& st = state(fd);
+            st.wr = PendingOp();
+            st.wr.kind = OP_CONNECT;
+            st.wr.handler = h;
+            st.wr.tag = tag;
+            st.wr.done = true;
+            st.wr.result = -err;
+            ready.push_back({fd, st.gen, true});
+            return;
+        }
+        submit(fd, true, OP_CONNECT, NULL, 0, h, tag);
+    }
+
+    void close(int fd) override {
+        FdState& st = state(fd);
+        if (st.registered) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        st.registered = false;
+        st.rd = PendingOp();
+        st.wr = PendingOp();
+        st.gen++;
+        ::close(fd);
+    }
+
+    void run() override {
+        struct epoll_event events[256];
+        while (1) {
+            run_ready();
+            bool more = run_deferred();
+            int timeout = run_timers();
+            if (!ready.empty() || more) timeout = 0;
+            int n = epoll_wait(epfd, events, 256, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait failed");
+                exit(1);
+            }
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u64 == UINT64_MAX) {
+                    run_posted();
+                    continue;
+                }
+                int fd = (int)(uint32_t)events[i].data.u64;
+                uint32_t gen = (uint32_t)(events[i].data.u64 >> 32);
+                uint32_t ev = events[i].events;
+                if ((size_t)fd >= fds.size() || fds[fd].gen != gen) continue;
+
+                // Ops that already completed on submission sit in the ready list.
+                if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && fds[fd].rd.kind != OP_NONE
+                        && !fds[fd].rd.done && attempt(fd, fds[fd].rd)) {
+                    complete(fd, false);
+                }
+                if (fds[fd].gen != gen) continue;
+                if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && fds[fd].wr.kind != OP_NONE
+                        && !fds[fd].wr.done && attempt(fd, fds[fd].wr)) {
+                    complete(fd, true);
+                }
+            }
+        }
+    }
+};
+
+// ----------------------------------------------------------
+//  io_uring Backend
+// ----------------------------------------------------------
+// Everything queued during a loop iteration is submitted with one
+// io_uring_enter() call. Accept and recv use multishot requests: recv data
+// lands in a registered provided-buffer ring and is copied out to the caller
+// when it asks for it, so an idle connection holds no kernel request buffer.
+// Sockets stay blocking here; io_uring arms its own poll for them.
+class UringLoop : public EventLoop {
+private:
+    enum OpKind { OP_NONE, OP_ACCEPT, OP_RECV, OP_SEND, OP_SENDV, OP_CONNECT, OP_SPLICE_IN, OP_SPLICE_OUT, OP_SENDFILE };
+    enum Slot { SLOT_WR, SLOT_ACCEPT, SLOT_RECV, SLOT_SPLICE, SLOT_FILL, SLOT_WAKE, SLOT_IGNORE };
+
+    static const unsigned RING_ENTRIES = 1024;
+    static const unsigned BUF_COUNT = 1024;   // most provided buffers, power of two
+    static const unsigned MIN_BUF_COUNT = 64; // fewest, whatever the relay chunk
+    static const size_t MAX_QUEUED = 8;       // unread buffers per fd before recv is paused
+
+    struct PendingOp {
+        OpKind kind = OP_NONE;
+        IoHandler* handler = nullptr;
+        int tag = 0;
+        char* buf = nullptr;
+        size_t len = 0;
+        int aux_fd = -1;   // pipe for splice reads
+    };
+
+    // A received provided buffer (bid >= 0), received data copied out of
+    // one (spill), or a final recv/accept result.
+    struct Chunk {
+        int bid;
+        uint32_t off;
+        uint32_t len;
+        ssize_t result;
+        string spill;
+
+        bool has_data() const { return bid >= 0 || !spill.empty(); }
+    };
+
+    struct FdState {
+        uint32_t gen = 0;
+        PendingOp rd, wr;
+        bool rd_ready = false;   // rd is queued on the ready list
+        bool multishot = false;  // a multishot accept/recv is armed
+        bool cancelling = false; // ...and a cancel for it has been queued
+        bool rd_inflight = false; // a splice read is in the kernel
+        bool wr_inflight = false;
+        bool starved = false;    // recv stopped with ENOBUFS, waiting for a free buffer
+        Slot ms_slot = SLOT_RECV;
+        deque<Chunk> queued;
+        struct sockaddr_storage addr;
+        struct msghdr msg;          // for sendmsg; read by the kernel at issue time
+        int sf_pipe[2] = {-1, -1}; // sendfile staging pipe
+        size_t sf_pending = 0;     // bytes parked in sf_pipe
+    };
+
+    struct ReadyOp {
+        int fd;
+        uint32_t gen;
+    };
+
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned sq_entries;
+    unsigned pending_submit;
+    deque<struct io_uring_sqe> overflow; // queued while the ring is full
+
+    struct io_uring_buf_ring* buf_ring;
+    char* buf_base;
+    size_t buf_size;    // one relay chunk
+    unsigned buf_count; // power of two, within BUF_RING_SIZE where it can be
+    uint16_t buf_tail;
+
+    uint64_t wake_value;
+    vector<FdState> fds;
+    vector<ReadyOp> ready;
+    deque<pair<int, uint32_t>> starved_fds;
+
+    static uint64_t user_data(int fd, uint32_t gen, Slot slot) {
+        return ((uint64_t)gen << 32) | ((uint64_t)(uint32_t)fd << 8) | slot;
+    }
+
+    FdState& state(int fd) {
+        if ((size_t)fd >= fds.size()) fds.resize(max((size_t)fd + 1, fds.size() * 2));
+        return fds[fd];
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void* arg = NULL, size_t argsz = 0) {
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+    }
+
+    // Submits everything queued; with wait, also blocks for a completion,
+    // for at most timeout_ms if that is not -1. Never runs completion
+    // handlers: if the kernel will not take more while its completion queue
+    // is backed up, this returns and the caller's reap() drains it.
+    void flush(bool wait, int timeout_ms = -1) {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)&ts;
+        while (1) {
+            refill_sq();
+            bool w = wait && overflow.empty();
+            int r = w && timeout_ms >= 0
+                        ? enter(pending_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg))
+                        : enter(pending_submit, w ? 1 : 0, w ? IORING_ENTER_GETEVENTS : 0);
+            if (r >= 0) {
+                pending_submit -= min((unsigned)r, pending_submit);
+                if (r > 0 && !overflow.empty()) continue; // room for more now
+                return;
+            }
+            if (errno == ETIME || errno == EAGAIN || errno == EBUSY) return;
+            if (errno == EINTR) {
+                if (wait) return;
+                continue;
+            }
+            perror("io_uring_enter failed");
+            exit(1);
+        }
+    }
+
+    unsigned sq_room() const { return sq_entries - (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)); }
+
+    struct io_uring_sqe* push_sqe() {
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+        struct io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending_submit++;
+        return sqe;
+    }
+
+    // Moves SQEs that did not fit into the ring, in order; a linked pair
+    // goes in only when both halves fit, so one submission carries both.
+    void refill_sq() {
+        while (!overflow.empty()) {
+            bool linked = overflow.front().flags & (IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+            if (sq_room() < (linked ? 2u : 1u)) break;
+            *push_sqe() = overflow.front();
+            overflow.pop_front();
+        }
+    }
+
+    // Returns a zeroed SQE with room behind it for the rest of an n-long
+    // link chain. Only submits, never reaps, so no handler runs and any
+    // FdState& the caller holds stays valid. When the ring is full and
+    // the kernel will not take it, SQEs wait in order on the overflow
+    // list until run() has drained completions.
+    struct io_uring_sqe* get_sqe(unsigned n = 1) {
+        if (overflow.empty() && sq_room() < n) flush(false);
+        if (!overflow.empty() || sq_room() < n) {
+            overflow.emplace_back();
+            memset(&overflow.back(), 0, sizeof(overflow.back()));
+            return &overflow.back();
+        }
+        return push_sqe();
+    }
+
+    void recycle(int bid) {
+        // Index the ring directly: in C++ the header's flexible-array wrapper
+        // shifts io_uring_buf_ring::bufs past the overlaid tail.
+        struct io_uring_buf* b = (struct io_uring_buf*)buf_ring + (buf_tail & (buf_count - 1));
+        b->addr = (uint64_t)(buf_base + (size_t)bid * buf_size);
+        b->len = (uint32_t)buf_size;
+        b->bid = (uint16_t)bid;
+        buf_tail++;
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+
+        // Give the freed buffer to a connection that ran dry.
+        while (!starved_fds.empty()) {
+            pair<int, uint32_t> w = starved_fds.front();
+            starved_fds.pop_front();
+            if ((size_t)w.first >= fds.size() || fds[w.first].gen != w.second || !fds[w.first].starved) continue;
+            fds[w.first].starved = false;
+            arm_recv(w.first);
+            break;
+        }
+    }
+
+    const char* chunk_data(const Chunk& c) const {
+        return c.bid >= 0 ? buf_base + (size_t)c.bid * buf_size : c.spill.data();
+    }
+
+    // Copies a chunk out of its provided buffer so the buffer can go back
+    // to the ring; returns the buffer to recycle, or -1.
+    int spill(Chunk& c) {
+        int bid = c.bid;
+        if (bid < 0) return -1;
+        c.spill.assign(buf_base + (size_t)bid * buf_size, c.len);
+        c.bid = -1;
+        return bid;
+    }
+
+    // The ring ran dry. Buffers parked with connections that are not
+    // reading (a pipelined response waiting its turn, say) may never come
+    // back on their own, so their data moves to the heap.
+    void reclaim_buffers() {
+        vector<int> freed;
+        for (FdState& st : fds) {
+            if (st.rd.kind != OP_NONE) continue;
+            for (Chunk& c : st.queued) {
+                int bid = spill(c);
+                if (bid >= 0) freed.push_back(bid);
+            }
+        }
+        for (int bid : freed) recycle(bid);
+    }
+
+    void drop_queued(FdState& st) {
+        for (const Chunk& c : st.queued) {
+            if (c.bid >= 0) recycle(c.bid);
+        }
+        st.queued.clear();
+    }
+
+    void arm_accept(int fd) {
+        FdState& st = fds[fd];
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = user_data(fd, st.gen, SLOT_ACCEPT);
+        st.multishot = true;
+        st.cancelling = false;
+        st.ms_slot = SLOT_ACCEPT;
+    }
+
+    void arm_recv(int fd) {
+        FdState& st = fds[fd];
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = user_data(fd, st.gen, SLOT_RECV);
+        st.multishot = true;
+        st.cancelling = false;
+        st.ms_slot = SLOT_RECV;
+    }
+
+    void cancel_multishot(int fd) {
+        FdState& st = fds[fd];
+        if (st.cancelling) return;
+        st.cancelling = true;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = user_data(fd, st.gen, st.ms_slot);
+        sqe->user_data = user_data(fd, st.gen, SLOT_IGNORE);
+    }
+
+    // A splice read must not race the multishot recv for socket data: what
+    // it already queued is written into the pipe first, then the recv is
+    // cancelled, and only once it has ended does the kernel splice directly.
+    void deliver_splice(int fd) {
+        FdState& st = fds[fd];
+        if (st.rd_inflight) return;
+        ssize_t res;
+        if (!st.queued.empty()) {
+            Chunk& c = st.queued.front();
+            if (c.has_data()) {
+                // The pipe is drained before each splice read, so this fits.
+                res = write(st.rd.aux_fd, chunk_data(c) + c.off, min((size_t)(c.len - c.off), st.rd.len));
+                if (res < 0) {
+                    res = -errno;
+                } else {
+                    c.off += res;
+                    if (c.off == c.len) {
+                        if (c.bid >= 0) recycle(c.bid);
+                        st.queued.pop_front();
+                    }
+                }
+            } else {
+                res = c.result;
+                st.queued.pop_front();
+            }
+        } else if (st.multishot) {
+            cancel_multishot(fd);
+            return;
+        } else {
+            st.starved = false;
+            st.rd_inflight = true;
+            struct io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = st.rd.aux_fd;
+            sqe->splice_fd_in = fd;
+            sqe->splice_off_in = (uint64_t)-1;
+            sqe->off = (uint64_t)-1;
+            sqe->len = (uint32_t)min(st.rd.len, (size_t)UINT32_MAX);
+            sqe->splice_flags = SPLICE_F_MOVE;
+            sqe->user_data = user_data(fd, st.gen, SLOT_SPLICE);
+            return;
+        }
+
+        IoHandler* h = st.rd.handler;
+        int tag = st.rd.tag;
+        st.rd = PendingOp();
+        h->on_io(tag, res); // may submit, close or delete; no references held
+    }
+
+    // Hands queued data to a pending read-side op, or arms the kernel for more.
+    void deliver_rd(int fd) {
+        FdState& st = fds[fd];
+        if (st.rd.kind == OP_NONE) return;
+        if (st.rd.kind == OP_SPLICE_IN) {
+            deliver_splice(fd);
+            return;
+        }
+        if (st.queued.empty()) {
+            if (!st.multishot && !st.starved) {
+                if (st.rd.kind == OP_ACCEPT) arm_accept(fd);
+                else arm_recv(fd);
+            }
+            return;
+        }
+
+        Chunk& c = st.queued.front();
+        ssize_t res = c.result;
+        if (c.has_data()) {
+            size_t n = min((size_t)(c.len - c.off), st.rd.len);
+            memcpy(st.rd.buf, chunk_data(c) + c.off, n);
+            c.off += n;
+            res = (ssize_t)n;
+            if (c.off == c.len) {
+                if (c.bid >= 0) recycle(c.bid);
+                st.queued.pop_front();
+            }
+        } else {
+            st.queued.pop_front();
+        }
+
+        IoHandler* h = st.rd.handler;
+        int tag = st.rd.tag;
+        st.rd = PendingOp();
+        h->on_io(tag, res); // may submit, close or delete; no references held
+    }
+
+    void queue_rd(int fd) {
+        FdState& st = fds[fd];
+        if (st.rd_ready) return;
+        st.rd_ready = true;
+        ready.push_back({fd, st.gen});
+    }
+
+    void run_ready() {
+        while (!ready.empty()) {
+            vector<ReadyOp> batch;
+            batch.swap(ready);
+            for (const ReadyOp& r : batch) {
+                if ((size_t)r.fd >= fds.size() || fds[r.fd].gen != r.gen) continue;
+                fds[r.fd].rd_ready = false;
+                deliver_rd(r.fd);
+            }
+        }
+    }
+
+    void on_cqe(const struct io_uring_cqe* cqe) {
+        Slot slot = (Slot)(cqe->user_data & 0xff);
+        int fd = (int)((cqe->user_data >> 8) & 0xffffff);
+        uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+        if (slot == SLOT_WAKE) {
+            run_posted();
+            arm_wake();
+            return;
+        }
+        if (slot == SLOT_IGNORE) return;
+
+        bool stale = (size_t)fd >= fds.size() || fds[fd].gen != gen;
+        if (stale) {
+            if (bid >= 0) recycle(bid);
+            if (slot == SLOT_ACCEPT && cqe->res >= 0) ::close(cqe->res);
+            return;
+        }
+        FdState& st = fds[fd];
+
+        if (slot == SLOT_FILL) {
+            if (cqe->res > 0) st.sf_pending += cqe->res;
+            return;
+        }
+        if (slot == SLOT_WR) {
+            st.wr_inflight = false;
+            if (st.wr.kind == OP_SENDFILE && cqe->res > 0) st.sf_pending -= cqe->res;
+            IoHandler* h = st.wr.handler;
+            int tag = st.wr.tag;
+            st.wr = PendingOp();
+            if (h) h->on_io(tag, cqe->res);
+            return;
+        }
+        if (slot == SLOT_SPLICE) {
+            st.rd_inflight = false;
+            IoHandler* h = st.rd.handler;
+            int tag = st.rd.tag;
+            st.rd = PendingOp();
+            if (h) h->on_io(tag, cqe->res);
+            return;
+        }
+
+        // SLOT_ACCEPT / SLOT_RECV
+        if (!more) st.multishot = st.cancelling = false;
+        bool starving = false;
+        if (bid >= 0) {
+            st.queued.push_back({bid, 0, (uint32_t)cqe->res, cqe->res, string()});
+            // The kernel keeps receiving until the cancel lands; what
+            // overshoots MAX_QUEUED does not get to hold a buffer.
+            if (st.queued.size() > MAX_QUEUED) recycle(spill(st.queued.back()));
+        } else if (cqe->res == -ENOBUFS) {
+            st.starved = true;
+            starved_fds.push_back({fd, gen});
+            starving = true;
+        } else if (cqe->res != -ECANCELED) {
+            st.queued.push_back({-1, 0, 0, cqe->res, string()});
+        }
+
+        if (st.multishot && st.queued.size() >= MAX_QUEUED) cancel_multishot(fd);
+        if (st.rd.kind != OP_NONE) deliver_rd(fd);
+        if (starving) reclaim_buffers();
+    }
+
+    // Copies each CQE out and frees its slot before running the handler.
+    void reap() {
+        while (1) {
+            unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+            struct io_uring_cqe cqe = cqes[head & *cq_mask];
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            on_cqe(&cqe);
+        }
+    }
+
+    void arm_wake() {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakefd;
+        sqe->addr = (uint64_t)&wake_value;
+        sqe->len = sizeof(wake_value);
+        sqe->user_data = user_data(0, 0, SLOT_WAKE);
+    }
+
+public:
+    // Returns NULL if this kernel lacks io_uring or provided-buffer rings.
+    static UringLoop* create() {
+        UringLoop* loop = new UringLoop();
+        if (loop->ring_fd < 0) {
+            delete loop;
+            return NULL;
+        }
+        return loop;
+    }
+
+    UringLoop() : ring_fd(-1), pending_submit(0), buf_ring(NULL), buf_base(NULL),
+                  buf_size(BufferPool::class_size(BufferPool::RELAY)), buf_count(BUF_COUNT), buf_tail(0) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries = RING_ENTRIES * 4;
+        int fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+        if (fd < 0) return;
+        if (!(p.features & IORING_FEAT_EXT_ARG)) {
+            ::close(fd); // needed for timed waits
+            return;
+        }
+
+        size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = max(sq_size, cq_size);
+        char* sq = (char*)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        char* cq = sq;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED) {
+            cq = (char*)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        }
+        sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+            ::close(fd);
+            return;
+        }
+        sq_head = (unsigned*)(sq + p.sq_off.head);
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+        sq_entries = p.sq_entries;
+
+        // Provided-buffer ring shared by every multishot recv on this loop.
+        // Larger relay chunks get fewer buffers, so -r does not multiply
+        // the memory each loop pins.
+        while (buf_count > MIN_BUF_COUNT && (size_t)buf_count * buf_size > BUF_RING_SIZE) buf_count /= 2;
+        buf_ring = (struct io_uring_buf_ring*)mmap(NULL, buf_count * sizeof(struct io_uring_buf),
+                                                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buf_base = (char*)mmap(NULL, (size_t)buf_count * buf_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = buf_count;
+        reg.bgid = 0;
+        if (buf_ring == MAP_FAILED || buf_base == MAP_FAILED
+                || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            ::close(fd);
+            return;
+        }
+        ring_fd = fd;
+        for (unsigned i = 0; i < buf_count; i++) recycle(i);
+
+        fds.resize(1024);
+        arm_wake();
+    }
+
+    void accept(int fd, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        st.rd = PendingOp();
+        st.rd.kind = OP_ACCEPT;
+        st.rd.handler = h;
+        st.rd.tag = tag;
+        queue_rd(fd);
+    }
+
+    void recv(int fd, char* buf, size_t len, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        st.rd = PendingOp();
+        st.rd.kind = OP_RECV;
+        st.rd.handler = h;
+        st.rd.tag = tag;
+        st.rd.buf = buf;
+        st.rd.len = len;
+        queue_rd(fd);
+    }
+
+    void send(int fd, const char* buf, size_t len, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        st.wr = PendingOp();
+        st.wr.kind = OP_SEND;
+        st.wr.handler = h;
+        st.wr.tag = tag;
+        st.wr_inflight = true;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)buf;
+        sqe->len = (uint32_t)min(len, (size_t)UINT32_MAX);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data(fd, st.gen, SLOT_WR);
+    }
+
+    void splice(int fd, int pipe_fd, size_t len, bool to_sock, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        if (!to_sock) {
+            st.rd = PendingOp();
+            st.rd.kind = OP_SPLICE_IN;
+            st.rd.handler = h;
+            st.rd.tag = tag;
+            st.rd.len = len;
+            st.rd.aux_fd = pipe_fd;
+            queue_rd(fd);
+            return;
+        }
+        st.wr = PendingOp();
+        st.wr.kind = OP_SPLICE_OUT;
+        st.wr.handler = h;
+        st.wr.tag = tag;
+        st.wr_inflight = true;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = fd;
+        sqe->splice_fd_in = pipe_fd;
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->off = (uint64_t)-1;
+        sqe->len = (uint32_t)min(len, (size_t)UINT32_MAX);
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = user_data(fd, st.gen, SLOT_WR);
+    }
+
+    // There is no sendfile opcode: splice the file range into a per-fd pipe
+    // with a linked splice from the pipe to the socket behind it. Bytes the
+    // socket did not take stay in the pipe and go out first next time.
+    // Each pipe slot holds one file page, so a range that starts mid-page
+    // is cut to fit the pipe: a short fill would cancel the linked send.
+    void sendfile(int fd, int file_fd, off_t off, size_t len, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        st.wr = PendingOp();
+        st.wr.kind = OP_SENDFILE;
+        st.wr.handler = h;
+        st.wr.tag = tag;
+        st.wr_inflight = true;
+        if (st.sf_pipe[0] < 0 && pipe2(st.sf_pipe, O_CLOEXEC) < 0) {
+            struct io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_NOP; // completes with 0, which callers treat as failure
+            sqe->user_data = user_data(fd, st.gen, SLOT_WR);
+            return;
+        }
+        len = min(len, (size_t)SPLICE_CHUNK);
+        struct io_uring_sqe* sqe;
+        if (st.sf_pending == 0) {
+            static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            if (len > SPLICE_CHUNK - off % page) len = SPLICE_CHUNK - off % page;
+            sqe = get_sqe(2);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = st.sf_pipe[1];
+            sqe->splice_fd_in = file_fd;
+            sqe->splice_off_in = (uint64_t)off;
+            sqe->off = (uint64_t)-1;
+            sqe->len = (uint32_t)len;
+            sqe->splice_flags = SPLICE_F_MOVE;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = user_data(fd, st.gen, SLOT_FILL);
+        } else {
+            len = min(len, st.sf_pending);
+        }
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = fd;
+        sqe->splice_fd_in = st.sf_pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->off = (uint64_t)-1;
+        sqe->len = (uint32_t)len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = user_data(fd, st.gen, SLOT_WR);
+    }
+
+    void sendv(int fd, const struct iovec* iov, int iovcnt, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        st.wr = PendingOp();
+        st.wr.kind = OP_SENDV;
+        st.wr.handler = h;
+        st.wr.tag = tag;
+        st.wr_inflight = true;
+        memset(&st.msg, 0, sizeof(st.msg));
+        st.msg.msg_iov = (struct iovec*)iov;
+        st.msg.msg_iovlen = iovcnt;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)&st.msg;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data(fd, st.gen, SLOT_WR);
+    }
+
+    void connect(int fd, const struct sockaddr* addr, socklen_t addrlen, IoHandler* h, int tag) override {
+        FdState& st = state(fd);
+        st.wr = PendingOp();
+        st.wr.kind = OP_CONNECT;
+        st.wr.handler = h;
+        st.wr.tag = tag;
+        st.wr_inflight = true;
+        memcpy(&st.addr, addr, addrlen);
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)&st.addr;
+        sqe->off = addrlen;
+        sqe->user_data = user_data(fd, st.gen, SLOT_WR);
+    }
+
+    bool holds_input(int fd) override { return !state(fd).queued.empty(); }
+
+    void close(int fd) override {
+        FdState& st = state(fd);
+        bool inflight = st.multishot || st.rd_inflight || st.wr_inflight;
+        drop_queued(st);
+        if (st.sf_pipe[0] >= 0) {
+            // In-flight splices hold their own references to the pipe.
+            ::close(st.sf_pipe[0]);
+            ::close(st.sf_pipe[1]);
+            st.sf_pipe[0] = st.sf_pipe[1] = -1;
+            st.sf_pending = 0;
+        }
+        st.rd = PendingOp();
+        st.wr = PendingOp();
+        st.rd_ready = st.multishot = st.cancelling = st.rd_inflight = st.wr_inflight = st.starved = false;
+        st.gen++;
+        if (!inflight) {
+            ::close(fd);
+            return;
+        }
+        // Cancel whatever is still in the kernel, then close in the same
+        // chain so the fd number cannot be reused before the cancel runs.
+        struct io_uring_sqe* sqe = get_sqe(2);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = user_data(fd, 0, SLOT_IGNORE);
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = user_data(fd, 0, SLOT_IGNORE);
+    }
+
+    void run() override {
+        while (1) {
+            run_ready();
+            bool more = run_deferred();
+            int timeout = run_timers();
+            flush(ready.empty() && !more, timeout);
+            reap();
+        }
+    }
+};
+
+// ----------------------------------------------------------
+//  Host Resolver
+// ----------------------------------------------------------
+// A small stub resolver: A and AAAA queries go over UDP to one nameserver
+// from a dedicated thread running its own event loop, and answers are
+// posted back to the requesting loops. Names are cached for their record
+// TTL (failures for the SOA minimum), concurrent lookups of a name share
+// one query, and a name asked for in the last tenth of its TTL is
+// refreshed in the background so hot hosts never wait on DNS.
+struct ResolvedAddr {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+class HostResolver : public IoHandler {
+public:
+    // Status 0 with every address found, IPv6 first, or -1 on failure.
+    typedef function<void(int, const vector<ResolvedAddr>&)> Callback;
+
+private:
+    enum { TYPE_A = 1, TYPE_AAAA = 28, TYPE_SOA = 6, TAG_RECV = -1 };
+
+    struct Waiter {
+        int port;
+        EventLoop* loop;
+        Callback done;
+    };
+
+    // One cached name; addrs carry port 0.
+    struct Name {
+        vector<ResolvedAddr> addrs;
+        bool negative = false;
+        uint64_t expires = 0;    // ms, monotonic
+        uint64_t refresh_at = 0; // first lookup after this refreshes ahead
+        bool resolving = false;
+        vector<Waiter> waiters;
+    };
+
+    // An A + AAAA query pair in flight (resolver thread only).
+    struct Query {
+        string name;
+        uint16_t ids[2];
+        bool answered[2];
+        int tries;
+        EventLoop::TimerId timer;
+        vector<ResolvedAddr> found[2];
+        uint32_t ttl;
+        bool failed;
+    };
+
+    mutex names_lock;
+    unordered_map<string, Name> names;
+    unordered_map<string, vector<ResolvedAddr>> hosts; // read-only after start()
+
+    EventLoop* loop = NULL; // resolver thread
+    int sock = -1;          // UDP, connected to the nameserver
+    char rbuf[1500];
+    unordered_map<uint16_t, Query*> queries; // both ids of each pair until it finishes
+    mt19937 rng;
+
+    atomic<uint64_t> hits{0}, misses{0}, coalesced{0}, refreshes{0}, timeouts{0};
+
+    static string normalize(const string& host) {
+        string h = host;
+        if (!h.empty() && h.back() == '.') h.pop_back();
+        transform(h.begin(), h.end(), h.begin(), ::tolower);
+        return h;
+    }
+
+    static bool parse_addr(const string& s, int port, ResolvedAddr& out) {
+        memset(&out.addr, 0, sizeof(out.addr));
+        struct sockaddr_in* v4 = (struct sockaddr_in*)&out.addr;
+        struct sockaddr_in6* v6 = (struct sockaddr_in6*)&out.addr;
+        if (inet_pton(AF_INET, s.c_str(), &v4->sin_addr) == 1) {
+            v4->sin_family = AF_INET;
+            v4->sin_port = htons(port);
+            out.len = sizeof(*v4);
+            return true;
+        }
+        if (inet_pton(AF_INET6, s.c_str(), &v6->sin6_addr) == 1) {
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons(port);
+            out.len = sizeof(*v6);
+            return true;
+        }
+        return false;
+    }
+
+    static vector<ResolvedAddr> with_port(vector<ResolvedAddr> addrs, int port) {
+        for (ResolvedAddr& a : addrs) {
+            if (a.addr.ss_family == AF_INET) ((struct sockaddr_in*)&a.addr)->sin_port = htons(port);
+            else ((struct sockaddr_in6*)&a.addr)->sin6_port = htons(port);
+        }
+        return addrs;
+    }
+
+    void load_hosts(const string& path) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) return;
+        char line[1024];
+        while (fgets(line, sizeof(line), f)) {
+            char* hash = strchr(line, '#');
+            if (hash) *hash = '\0';
+            char* save = NULL;
+            char* tok = strtok_r(line, " \t\r\n", &save);
+            ResolvedAddr a;
+            if (!tok || !parse_addr(tok, 0, a)) continue;
+            while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) hosts[normalize(tok)].push_back(a);
+        }
+        fclose(f);
+    }
+
+    // First "nameserver" line of resolv.conf, else the local host.
+    static string system_nameserver() {
+        FILE* f = fopen("/etc/resolv.conf", "r");
+        string ns = "127.0.0.1";
+        if (!f) return ns;
+        char line[512], addr[256];
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, " nameserver %255s", addr) == 1) {
+                ns = addr;
+                break;
+            }
+        }
+        fclose(f);
+        return ns;
+    }
+
+    // Wire format of a query for name; false if name is not a valid DNS name.
+    static bool build_query(const string& name, uint16_t id, int type, string& out) {
+        static const unsigned char header[10] = {0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0}; // RD, one question
+        out.assign(1, (char)(id >> 8));
+        out += (char)(id & 0xff);
+        out.append((const char*)header, sizeof(header));
+        size_t start = 0;
+        while (start < name.size()) {
+            size_t dot = name.find('.', start);
+            if (dot == string::npos) dot = name.size();
+            size_t len = dot - start;
+            if (len == 0 || len > 63) return false;
+            out += (char)len;
+            out.append(name, start, len);
+            start = dot + 1;
+        }
+        if (name.empty() || name.size() > 253) return false;
+        out += '\0';
+        out += (char)(type >> 8);
+        out += (char)(type & 0xff);
+        out += '\0';
+        out += (char)1; // class IN
+        return true;
+    }
+
+    // Reads a possibly compressed name at off into out; returns the offset
+    // just past it in the message, or 0 if it is malformed.
+    static size_t read_name(const unsigned char* msg, size_t n, size_t off, string* out) {
+        size_t end = 0;
+        for (int jumps = 0; jumps < 16; ) {
+            if (off >= n) return 0;
+            unsigned len = msg[off];
+            if (len == 0) return end ? end : off + 1;
+            if ((len & 0xc0) == 0xc0) {
+                if (off + 1 >= n) return 0;
+                if (!end) end = off + 2;
+                off = ((len & 0x3f) << 8) | msg[off + 1];
+                jumps++;
+                continue;
+            }
+            if (off + 1 + len > n) return 0;
+            if (out) {
+                if (!out->empty()) *out += '.';
+                out->append((const char*)msg + off + 1, len);
+            }
+            off += 1 + len;
+        }
+        return 0;
+    }
+
+    static uint32_t be32(const unsigned char* p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+
+    // Sends the unanswered half of q, or fails the lookup at once if its
+    // name cannot be put on the wire; q is gone in that case.
+    void send_query(Query* q) {
+        for (int i = 0; i < 2; i++) {
+            string pkt;
+            if (q->answered[i]) continue;
+            if (!build_query(q->name, q->ids[i], i == 0 ? TYPE_AAAA : TYPE_A, pkt)) {
+                q->failed = true;
+                finish(q);
+                return;
+            }
+            ::send(sock, pkt.data(), pkt.size(), 0); // a lost datagram is retried on timeout
+        }
+        q->timer = loop->add_timer(DNS_TIMEOUT_MS, this, q->ids[0]);
+    }
+
+    // Resolver thread: starts the query pair for a name being resolved.
+    void start_query(const string& name) {
+        Query* q = new Query();
+        q->name = name;
+        for (int i = 0; i < 2; i++) {
+            uint16_t id;
+            do {
+                id = (uint16_t)rng();
+            } while (queries.count(id));
+            q->ids[i] = id;
+            queries[id] = q;
+            q->answered[i] = false;
+        }
+        q->tries = 1;
+        q->ttl = DNS_MAX_TTL;
+        q->failed = false;
+        send_query(q);
+    }
+
+    void handle_response(const unsigned char* msg, size_t n) {
+        if (n < 12 || !(msg[2] & 0x80)) return;
+        auto it = queries.find((uint16_t)((msg[0] << 8) | msg[1]));
+        if (it == queries.end()) return;
+        Query* q = it->second;
+        int slot = (q->ids[0] == it->first) ? 0 : 1;
+        if (q->answered[slot]) return;
+
+        // The echoed question must be ours before the answer is believed.
+        int qdcount = (msg[4] << 8) | msg[5];
+        int ancount = (msg[6] << 8) | msg[7];
+        int nscount = (msg[8] << 8) | msg[9];
+        string qname;
+        size_t off = read_name(msg, n, 12, &qname);
+        if (qdcount != 1 || off == 0 || off + 4 > n || normalize(qname) != q->name) return;
+        off += 4;
+
+        int rcode = msg[3] & 0x0f;
+        int want = slot == 0 ? TYPE_AAAA : TYPE_A;
+        bool failed = (rcode != 0 && rcode != 3); // anything but an answer or NXDOMAIN
+        for (int i = 0; !failed && i < ancount + nscount; i++) {
+            off = read_name(msg, n, off, NULL);
+            if (off == 0 || off + 10 > n) break;
+            int type = (msg[off] << 8) | msg[off + 1];
+            uint32_t ttl = be32(msg + off + 4);
+            size_t rdlen = (msg[off + 8] << 8) | msg[off + 9];
+            const unsigned char* rd = msg + off + 10;
+            off += 10 + rdlen;
+            if (off > n) break;
+            if (i < ancount && type == want) {
+                ResolvedAddr a;
+                memset(&a.addr, 0, sizeof(a.addr));
+                if (type == TYPE_A && rdlen == 4) {
+                    struct sockaddr_in* v4 = (struct sockaddr_in*)&a.addr;
+                    v4->sin_family = AF_INET;
+                    memcpy(&v4->sin_addr, rd, 4);
+                    a.len = sizeof(*v4);
+                } else if (type == TYPE_AAAA && rdlen == 16) {
+                    struct sockaddr_in6* v6 = (struct sockaddr_in6*)&a.addr;
+                    v6->sin6_family = AF_INET6;
+                    memcpy(&v6->sin6_addr, rd, 16);
+                    a.len = sizeof(*v6);
+                } else {
+                    continue;
+                }
+                q->found[slot].push_back(a);
+                q->ttl = min(q->ttl, ttl);
+            } else if (i >= ancount && type == TYPE_SOA && rdlen >= 20) {
+                // Negative answers live for min(SOA TTL, SOA minimum), RFC 2308.
+                q->ttl = min(q->ttl, min(ttl, be32(rd + rdlen - 4)));
+            }
+        }
+        if (failed) q->failed = true;
+        q->answered[slot] = true;
+        if (q->answered[0] && q->answered[1]) {
+            loop->cancel_timer(q->timer);
+            finish(q);
+        }
+    }
+
+    void on_timeout(Query* q) {
+        if (q->tries < DNS_TRIES) {
+            q->tries++;
+            send_query(q);
+            return;
+        }
+        timeouts.fetch_add(1, memory_order_relaxed);
+        q->failed = true;
+        finish(q);
+    }
+
+    // Stores the outcome and hands it to everyone waiting on the name.
+    void finish(Query* q) {
+        vector<ResolvedAddr> addrs = q->found[0];
+        addrs.insert(addrs.end(), q->found[1].begin(), q->found[1].end());
+        bool negative = addrs.empty();
+        uint32_t ttl = (negative && q->failed) ? DNS_FAILURE_TTL : q->ttl;
+        if (negative && ttl == DNS_MAX_TTL) ttl = DNS_FAILURE_TTL; // no SOA to go by
+        queries.erase(q->ids[0]);
+        queries.erase(q->ids[1]);
+        uint64_t now = EventLoop::now_ms();
+        vector<Waiter> waiters;
+        {
+            lock_guard<mutex> lock(names_lock);
+            Name& e = names[q->name];
+            e.resolving = false;
+            waiters.swap(e.waiters);
+            // A failed refresh keeps serving the old answer until it expires.
+            if (!(negative && !e.negative && e.expires > now)) {
+                e.addrs = addrs;
+                e.negative = negative;
+                e.expires = now + (uint64_t)ttl * 1000;
+                e.refresh_at = now + (uint64_t)ttl * 900;
+            }
+        }
+        for (Waiter& w : waiters) {
+            vector<ResolvedAddr> result = with_port(addrs, w.port);
+            Callback done = move(w.done);
+            int status = negative ? -1 : 0;
+            w.loop->post([done, status, result]() { done(status, result); });
+        }
+        delete q;
+    }
+
+    // Caller holds names_lock. Drops expired names once the cache is full.
+    void make_room(uint64_t now) {
+        if (names.size() < DNS_CACHE_SIZE) return;
+        for (auto it = names.begin(); it != names.end(); ) {
+            if (!it->second.resolving && it->second.expires <= now) it = names.erase(it);
+            else ++it;
+        }
+        for (auto it = names.begin(); names.size() >= DNS_CACHE_SIZE && it != names.end(); ) {
+            if (!it->second.resolving) it = names.erase(it);
+            else ++it;
+        }
+    }
+
+public:
+    HostResolver() : rng(random_device()()) {}
+
+    // nameserver is "addr", "addr:port" or "[v6addr]:port"; empty means
+    // the first one in /etc/resolv.conf.
+    void start(const string& nameserver, const string& hosts_path) {
+        load_hosts(hosts_path);
+        string ns = nameserver.empty() ? system_nameserver() : nameserver;
+        int port = 53;
+        size_t colon = ns.rfind(':');
+        if (ns[0] == '[') {
+            size_t close = ns.find(']');
+            if (close != string::npos && colon > close) port = atoi(ns.c_str() + colon + 1);
+            ns = ns.substr(1, close == string::npos ? string::npos : close - 1);
+        } else if (colon != string::npos && ns.find(':') == colon) {
+            port = atoi(ns.c_str() + colon + 1);
+            ns = ns.substr(0, colon);
+        }
+        ResolvedAddr server;
+        if (!parse_addr(ns, port, server)) {
+            fprintf(stderr, "Bad nameserver address: %s\n", ns.c_str());
+            exit(1);
+        }
+
+        loop = new EpollLoop();
+        sock = socket(server.addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC | loop->sock_flags, 0);
+        if (sock < 0 || ::connect(sock, (struct sockaddr*)&server.addr, server.len) < 0) {
+            perror("Resolver socket failed");
+            exit(1);
+        }
+        loop->recv(sock, rbuf, sizeof(rbuf), this, TAG_RECV);
+        thread([this]() { loop->run(); }).detach();
+    }
+
+    // Answers from the hosts file or the cache without waiting; true if
+    // status and addrs were filled in. May start a refresh-ahead query.
+    bool cached(const string& host, int port, int& status, vector<ResolvedAddr>& addrs) {
+        ResolvedAddr a;
+        if (parse_addr(host, port, a)) {
+            status = 0;
+            addrs.assign(1, a);
+            return true;
+        }
+        string name = normalize(host);
+        auto h = hosts.find(name);
+        if (h != hosts.end()) {
+            status = 0;
+            addrs = with_port(h->second, port);
+            return true;
+        }
+        uint64_t now = EventLoop::now_ms();
+        bool refresh = false;
+        {
+            lock_guard<mutex> lock(names_lock);
+            auto it = names.find(name);
+            if (it == names.end() || it->second.expires <= now) return false;
+            Name& e = it->second;
+            status = e.negative ? -1 : 0;
+            addrs = with_port(e.addrs, port);
+            if (!e.negative && !e.resolving && now >= e.refresh_at) {
+                e.resolving = true;
+                refresh = true;
+            }
+        }
+        hits.fetch_add(1, memory_order_relaxed);
+        if (refresh) {
+            refreshes.fetch_add(1, memory_order_relaxed);
+            loop->post([this, name]() { start_query(name); });
+        }
+        return true;
+    }
+
+    // Resolves host, calling done on the given loop.
+    void lookup(const string& host, int port, EventLoop* caller, Callback done) {
+        int status;
+        vector<ResolvedAddr> addrs;
+        if (cached(host, port, status, addrs)) {
+            caller->post([done, status, addrs]() { done(status, addrs); });
+            return;
+        }
+        string name = normalize(host);
+        string probe;
+        if (!build_query(name, 0, TYPE_A, probe)) {
+            caller->post([done]() { done(-1, vector<ResolvedAddr>()); });
+            return;
+        }
+        bool start = false;
+        {
+            lock_guard<mutex> lock(names_lock);
+            make_room(EventLoop::now_ms());
+            Name& e = names[name];
+            e.waiters.push_back({port, caller, move(done)});
+            if (!e.resolving) e.resolving = start = true;
+        }
+        if (start) {
+            misses.fetch_add(1, memory_order_relaxed);
+            loop->post([this, name]() { start_query(name); });
+        } else {
+            coalesced.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    void on_io(int tag, ssize_t res) override {
+        if (tag == TAG_RECV) {
+            if (res > 0) handle_response((const unsigned char*)rbuf, res);
+            loop->recv(sock, rbuf, sizeof(rbuf), this, TAG_RECV);
+            return;
+        }
+        auto it = queries.find((uint16_t)tag);
+        if (it != queries.end()) on_timeout(it->second);
+    }
+
+    void report(FILE* out) {
+        size_t n;
+        {
+            lock_guard<mutex> lock(names_lock);
+            n = names.size();
+        }
+        fprintf(out, "Resolver: %zu names, %llu hits, %llu misses, %llu coalesced, %llu refreshes, %llu timeouts\n", n,
+                (unsigned long long)hits.load(), (unsigned long long)misses.load(), (unsigned long long)coalesced.load(),
+                (unsigned long long)refreshes.load(), (unsigned long long)timeouts.load());
+        fflush(out);
+    }
+};
+
+thread_local EventLoop* EventLoop::current = NULL;
+
+EventLoop* createEventLoop(const string& backend) {
+    if (backend == "uring") {
+        UringLoop* loop = UringLoop::create();
+        if (loop) return loop;
+        fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+    }
+    return new EpollLoop();
+}
+
+// ----------------------------------------------------------
+//  Work-Stealing Scheduler
+// ----------------------------------------------------------
+// Each serving event loop is a worker with its own Chase-Lev deque of
+// tasks. The CPU-side stages of a connection (request processing and cache
+// lookup, cache store) are spawned as tasks on the local deque and run
+// between I/O batches; a worker with nothing to do steals from the others
+// before it blocks. I/O stays on the loop that owns the sockets, so a
+// stolen stage resumes on that loop before touching them.
+struct Task {
+    virtual void run_task() = 0;
+    virtual ~Task() {}
+};
+
+template <typename T>
+class WsDeque {
+private:
+    static const int64_t CAPACITY = 4096; // power of two
+
+    alignas(64) atomic<int64_t> top;
+    alignas(64) atomic<int64_t> bottom;
+    unique_ptr<atomic<T>[]> buf;
+
+public:
+    WsDeque() : top(0), bottom(0), buf(new atomic<T>[CAPACITY]) {}
+
+    int64_t size() const {
+        return max<int64_t>(0, bottom.load(memory_order_relaxed) - top.load(memory_order_relaxed));
+    }
+
+    // Owner only.
+    bool push(T x) {
+        int64_t b = bottom.load(memory_order_relaxed);
+        int64_t t = top.load(memory_order_acquire);
+        if (b - t >= CAPACITY) return false;
+        buf[b & (CAPACITY - 1)].store(x, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        bottom.store(b + 1, memory_order_relaxed);
+        return true;
+    }
+
+    // Owner only; takes the newest task.
+    bool pop(T& x) {
+        int64_t b = bottom.load(memory_order_relaxed) - 1;
+        bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t t = top.load(memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, memory_order_relaxed);
+            return false;
+        }
+        x = buf[b & (CAPACITY - 1)].load(memory_order_relaxed);
+        if (t == b) {
+            bool won = top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+            bottom.store(b + 1, memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread; takes the oldest task.
+    bool steal(T& x) {
+        int64_t t = top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t b = bottom.load(memory_order_acquire);
+        if (t >= b) return false;
+        x = buf[t & (CAPACITY - 1)].load(memory_order_relaxed);
+        return top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    }
+};
+
+class Scheduler {
+private:
+    static const int TASK_BUDGET = 64; // local tasks per loop iteration
+
+    struct Worker {
+        WsDeque<Task*> tasks;
+        EventLoop* loop;
+        atomic<bool> idle;
+        unsigned seed;
+        Worker(EventLoop* l, unsigned s) : loop(l), idle(false), seed(s) {}
+    };
+
+    vector<Worker*> workers; // fixed before any loop starts running
+    atomic<int> idle_count;
+    static thread_local Worker* current;
+
+    bool run(Worker* w) {
+        current = w;
+        if (w->idle.load(memory_order_relaxed)) {
+            w->idle.store(false, memory_order_relaxed);
+            idle_count.fetch_sub(1, memory_order_relaxed);
+        }
+
+        Task* t;
+        for (int i = 0; i < TASK_BUDGET && w->tasks.pop(t); i++) t->run_task();
+        if (w->tasks.size() > 0) return true;
+
+        // Out of local work: try the other workers, starting at a random one.
+        size_t n = workers.size();
+        if (n > 1) {
+            w->seed = w->seed * 1103515245 + 12345;
+            size_t start = (w->seed >> 16) % n;
+            for (size_t i = 0; i < n; i++) {
+                Worker* victim = workers[(start + i) % n];
+                if (victim != w && victim->tasks.steal(t)) {
+                    t->run_task();
+                    return true;
+                }
+            }
+        }
+
+        w->idle.store(true, memory_order_relaxed);
+        idle_count.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    void wake_idle(Worker* self) {
+        for (Worker* w : workers) {
+            if (w != self && w->idle.load(memory_order_relaxed)) {
+                w->loop->notify();
+                return;
+            }
+        }
+    }
+
+public:
+    Scheduler() : idle_count(0) {}
+
+    void add_worker(EventLoop* loop) {
+        Worker* w = new Worker(loop, (unsigned)workers.size() + 1);
+        workers.push_back(w);
+        loop->run_tasks = [this, w]() { return run(w); };
+    }
+
+    // Queues t on the calling worker. False if it was not queued (off-worker
+    // or the deque is full); the caller then runs it itself.
+    bool spawn(Task* t) {
+        Worker* w = current;
+        if (w == NULL || !w->tasks.push(t)) return false;
+        if (idle_count.load(memory_order_relaxed) > 0 && w->tasks.size() > 1) wake_idle(w);
+        return true;
+    }
+};
+
+thread_local Scheduler::Worker* Scheduler::current = NULL;
+
+// Global State
+int port_number = 8080;
+string io_backend = "epoll";
+int num_listeners = 1;
+int num_workers = 0;
+string cache_storage = "heap";
+int connect_timeout_ms = CONNECT_TIMEOUT_MS;
+string nameserver;                 // empty: first nameserver in /etc/resolv.conf
+string hosts_file = "/etc/hosts";
+int client_idle_timeout_ms = CLIENT_IDLE_TIMEOUT_MS;
+int client_max_requests = CLIENT_MAX_REQUESTS;
+int cache_shards = CACHE_SHARDS;
+string eviction_policy = EVICTION_POLICY;
+size_t admission_window = ADMISSION_WINDOW;
+size_t max_object_size = MAX_ELEMENT_SIZE;
+LRUCache cache(MAX_CACHE_SIZE);
+HostResolver resolver;
+Scheduler scheduler;
+
+
+void pinToCpu(thread& t, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Could not pin thread to CPU %d\n", cpu);
+    }
+}
+
+string buildErrorMessage(int status_code) {
+    char str[1024];
+    time_t now = time(0);
+    struct tm data = *gmtime(&now);
+    char timebuf[128];
+    strftime(timebuf, sizeof(timebuf), "%a, %d %b %Y %H:%M:%S %Z", &data);
+
+    string msg;
+    switch(status_code) {
+        case 400: msg = "400 Bad Request"; break;
+        case 408: msg = "408 Request Timeout"; break;
+        case 500: msg = "500 Internal Server Error"; break;
+        case 501: msg = "501 Not Implemented"; break;
+        case 502: msg = "502 Bad Gateway"; break;
+        case 503: msg = "503 Service Unavailable"; break;
+        case 504: msg = "504 Gateway Timeout"; break;
+        default: msg = "500 Internal Server Error"; break;
+    }
+    snprintf(str, sizeof(str), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\nDate: %s\r\n\r\n", status_code, msg.c_str(), timebuf);
+    return string(str);
+}
+
+// Whoever admitted a connection; told when it finishes so it can admit more.
+struct ConnectionOwner {
+    virtual void connection_closed() = 0;
+    virtual ~ConnectionOwner() {}
+};
+
+// ----------------------------------------------------------
+//  Coroutine Plumbing
+// ----------------------------------------------------------
+// Connections are written as sequential C++20 coroutines. Each co_await
+// submits one loop operation and parks the frame until its completion
+// arrives, so an in-flight request costs a small heap frame, not a thread.
+
+// Top-level coroutine: starts immediately and frees its frame on return.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return Detached(); }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// Awaitable sub-coroutine: starts when awaited and resumes the caller
+// with its result when it returns.
+template <typename T>
+class Co {
+public:
+    struct promise_type {
+        T value;
+        coroutine_handle<> caller;
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> h) noexcept {
+                return h.promise().caller;
+            }
+            void await_resume() noexcept {}
+        };
+
+        Co get_return_object() { return Co(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = move(v); }
+        void unhandled_exception() { terminate(); }
+    };
+
+private:
+    coroutine_handle<promise_type> h;
+
+    explicit Co(coroutine_handle<promise_type> handle) : h(handle) {}
+
+public:
+    Co(Co&& o) : h(o.h) { o.h = nullptr; }
+    Co(const Co&) = delete;
+    ~Co() {
+        if (h) h.destroy();
+    }
+
+    bool await_ready() { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) {
+        h.promise().caller = caller;
+        return h;
+    }
+    T await_resume() { return move(h.promise().value); }
+};
+
+// One socket operation on an event loop; resumes with the loop result
+// (bytes or -errno). The *_ALL kinds resubmit until everything is written.
+class LoopOp : public IoHandler {
+public:
+    enum Kind { RECV, SEND_ALL, SENDV_ALL, SPLICE_IN, SPLICE_OUT, SENDFILE_ALL };
+
+private:
+    EventLoop& loop;
+    Kind kind;
+    int fd;
+    char* buf;
+    size_t len;
+    int aux_fd;       // pipe (splice) or file (sendfile)
+    off_t file_off;   // SENDFILE_ALL: where len starts in the file
+    struct iovec* iov; // SENDV_ALL: advanced in place past what was sent
+    int iovcnt;
+    size_t sent;
+    ssize_t result;
+    coroutine_handle<> waiter;
+
+    void submit() {
+        switch (kind) {
+        case RECV: loop.recv(fd, buf, len, this, 0); break;
+        case SEND_ALL: loop.send(fd, buf + sent, len - sent, this, 0); break;
+        case SENDV_ALL: loop.sendv(fd, iov, iovcnt, this, 0); break;
+        case SPLICE_IN: loop.splice(fd, aux_fd, len, false, this, 0); break;
+        case SPLICE_OUT: loop.splice(fd, aux_fd, len, true, this, 0); break;
+        case SENDFILE_ALL: loop.sendfile(fd, aux_fd, file_off + sent, len - sent, this, 0); break;
+        }
+    }
+
+public:
+    LoopOp(EventLoop& l, Kind k, int f, const void* b, size_t n, int p = -1, off_t off = 0)
+        : loop(l), kind(k), fd(f), buf((char*)b), len(n), aux_fd(p), file_off(off), iov(NULL), iovcnt(0), sent(0), result(0) {}
+
+    LoopOp(EventLoop& l, int f, struct iovec* v, int n)
+        : loop(l), kind(SENDV_ALL), fd(f), buf(NULL), len(0), aux_fd(-1), file_off(0),
+          iov(v), iovcnt(n), sent(0), result(0) {}
+
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<> h) {
+        waiter = h;
+        submit();
+    }
+    ssize_t await_resume() { return result; }
+
+    void on_io(int, ssize_t res) override {
+        if (kind == SEND_ALL || kind == SENDV_ALL || kind == SENDFILE_ALL) {
+            if (res == 0) res = -EPIPE;
+            if (res > 0) {
+                sent += res;
+                if (kind == SENDV_ALL) {
+                    size_t n = res;
+                    while (iovcnt > 0 && n >= iov->iov_len) {
+                        n -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                    }
+                    if (iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + n;
+                        iov->iov_len -= n;
+                    }
+                }
+                if (kind == SENDV_ALL ? iovcnt > 0 : sent < len) {
+                    submit();
+                    return;
+                }
+                res = sent;
+            }
+        }
+        result = res;
+        waiter.resume();
+    }
+};
+
+LoopOp async_recv(EventLoop& loop, int fd, void* buf, size_t len) {
+    return LoopOp(loop, LoopOp::RECV, fd, buf, len);
+}
+
+LoopOp async_send_all(EventLoop& loop, int fd, const void* buf, size_t len) {
+    return LoopOp(loop, LoopOp::SEND_ALL, fd, buf, len);
+}
+
+// iov is consumed in place.
+LoopOp async_sendv_all(EventLoop& loop, int fd, struct iovec* iov, int iovcnt) {
+    return LoopOp(loop, fd, iov, iovcnt);
+}
+
+// Sends len bytes of file_fd starting at off.
+LoopOp async_sendfile_all(EventLoop& loop, int fd, int file_fd, off_t off, size_t len) {
+    return LoopOp(loop, LoopOp::SENDFILE_ALL, fd, NULL, len, file_fd, off);
+}
+
+// Socket -> pipe (to_sock false) or pipe -> socket, up to len bytes.
+LoopOp async_splice(EventLoop& loop, int fd, int pipe_fd, size_t len, bool to_sock) {
+    return LoopOp(loop, to_sock ? LoopOp::SPLICE_OUT : LoopOp::SPLICE_IN, fd, NULL, len, pipe_fd);
+}
+
+// Hostname lookup; completes at once from the hosts file or the DNS
+// cache, otherwise resumes on the given loop once the resolver answers.
+class ResolveOp {
+private:
+    EventLoop& loop;
+    string host;
+    int port;
+    coroutine_handle<> waiter;
+
+public:
+    int status;
+    vector<ResolvedAddr> addrs;
+
+    ResolveOp(EventLoop& l, const string& h, int p) : loop(l), host(h), port(p), status(-1) {}
+
+    bool await_ready() { return resolver.cached(host, port, status, addrs); }
+    void await_suspend(coroutine_handle<> h) {
+        waiter = h;
+        resolver.lookup(host, port, &loop,
+            [this](int s, const vector<ResolvedAddr>& a) {
+                status = s;
+                addrs = a;
+                waiter.resume();
+            });
+    }
+    void await_resume() {}
+};
+
+// Happy Eyeballs (RFC 8305): races connects to the resolved addresses,
+// alternating families, starting the next attempt HAPPY_EYEBALLS_DELAY ms
+// after the last or as soon as one fails. The first to connect wins and
+// the rest are closed. Resumes with the connected fd, -ETIMEDOUT once the
+// deadline passes, or the last connect error.
+class ConnectOp : public IoHandler {
+private:
+    enum { TAG_STAGGER = -1, TAG_DEADLINE = -2 };
+
+    EventLoop& loop;
+    vector<ResolvedAddr> order;
+    vector<int> fds;           // one per started attempt; -1 once it failed
+    size_t next;               // next address in order to try
+    int in_flight;
+    int last_error;
+    EventLoop::TimerId stagger, deadline;
+    bool stagger_armed;
+    uint64_t timeout_ms;
+    int result;
+    coroutine_handle<> waiter;
+
+    // Starts connects until one is in flight or the addresses run out.
+    void start_next() {
+        while (next < order.size()) {
+            const ResolvedAddr& a = order[next++];
+            int fd = socket(a.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | loop.sock_flags, 0);
+            if (fd < 0) {
+                last_error = -errno;
+                continue;
+            }
+            fds.push_back(fd);
+            in_flight++;
+            loop.connect(fd, (const struct sockaddr*)&a.addr, a.len, this, (int)fds.size() - 1);
+            if (next < order.size()) {
+                stagger = loop.add_timer(HAPPY_EYEBALLS_DELAY, this, TAG_STAGGER);
+                stagger_armed = true;
+            }
+            return;
+        }
+    }
+
+    void finish(int res) {
+        if (stagger_armed) loop.cancel_timer(stagger);
+        loop.cancel_timer(deadline);
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i] >= 0 && fds[i] != res) loop.close(fds[i]);
+        }
+        result = res;
+        waiter.resume();
+    }
+
+public:
+    ConnectOp(EventLoop& l, const vector<ResolvedAddr>& addrs, uint64_t ms)
+        : loop(l), next(0), in_flight(0), last_error(-EHOSTUNREACH), stagger_armed(false),
+          timeout_ms(ms), result(-1) {
+        // Interleave the families, led by whichever the resolver put first.
+        vector<const ResolvedAddr*> first, second;
+        for (size_t i = 0; i < addrs.size(); i++) {
+            if (addrs[i].addr.ss_family == addrs[0].addr.ss_family) first.push_back(&addrs[i]);
+            else second.push_back(&addrs[i]);
+        }
+        for (size_t i = 0; i < max(first.size(), second.size()); i++) {
+            if (i < first.size()) order.push_back(*first[i]);
+            if (i < second.size()) order.push_back(*second[i]);
+        }
+    }
+
+    bool await_ready() { return false; }
+    bool await_suspend(coroutine_handle<> h) {
+        waiter = h;
+        start_next();
+        if (in_flight == 0) {
+            result = last_error;
+            return false;
+        }
+        deadline = loop.add_timer(timeout_ms, this, TAG_DEADLINE);
+        return true;
+    }
+    int await_resume() { return result; }
+
+    void on_io(int tag, ssize_t res) override {
+        if (tag == TAG_DEADLINE) {
+            finish(-ETIMEDOUT);
+            return;
+        }
+        if (tag == TAG_STAGGER) {
+            stagger_armed = false;
+            start_next();
+            return;
+        }
+        in_flight--;
+        if (res >= 0) {
+            finish(fds[tag]);
+            return;
+        }
+        last_error = (int)res;
+        loop.close(fds[tag]);
+        fds[tag] = -1;
+        if (stagger_armed) {
+            loop.cancel_timer(stagger);
+            stagger_armed = false;
+        }
+        start_next();
+        if (in_flight == 0) finish(last_error);
+    }
+};
+
+// Continues the coroutine as a scheduler task, which an idle worker may
+// steal. Runs straight on if the task cannot be queued.
+struct ScheduleOp : public Task {
+    coroutine_handle<> waiter;
+
+    bool await_ready() { return false; }
+    bool await_suspend(coroutine_handle<> h) {
+        waiter = h;
+        return scheduler.spawn(this);
+    }
+    void await_resume() {}
+    void run_task() override { waiter.resume(); }
+};
+
+// Moves the coroutine back to the loop that owns its sockets.
+struct ResumeOn {
+    EventLoop& loop;
+
+    bool await_ready() { return EventLoop::current == &loop; }
+    void await_suspend(coroutine_handle<> h) {
+        loop.post([h]() { h.resume(); });
+    }
+    void await_resume() {}
+};
+
+// Follower side of a Fetch: resumes on loop once the fetch has more than
+// seen bytes to send or has ended, and reports where it stands.
+struct FetchOp {
+    EventLoop& loop;
+    Fetch& fetch;
+    size_t seen;
+    Fetch::State state = Fetch::PENDING;
+    const char* base = nullptr;
+    size_t avail = 0;
+
+    FetchOp(EventLoop& l, Fetch& f, size_t s) : loop(l), fetch(f), seen(s) {}
+
+    bool moved() const {
+        return fetch.state >= Fetch::DONE || (fetch.state == Fetch::STREAMING && fetch.avail > seen);
+    }
+
+    bool await_ready() { return false; }
+    bool await_suspend(coroutine_handle<> h) {
+        lock_guard<mutex> guard(fetch.lock);
+        if (moved()) return false;
+        EventLoop* l = &loop;
+        fetch.waiters.push_back([l, h]() { l->post([h]() { h.resume(); }); });
+        return true;
+    }
+    void await_resume() {
+        lock_guard<mutex> guard(fetch.lock);
+        state = fetch.state;
+        base = fetch.base;
+        avail = fetch.avail;
+    }
+};
+
+// ----------------------------------------------------------
+//  Upstream Connection Pool
+// ----------------------------------------------------------
+// Idle keep-alive connections to origins, per loop (a socket belongs to
+// the loop that registered it) and keyed by "host:port". The newest idle
+// connection is reused first; each one is closed after its idle timeout,
+// and anything the origin sent or closed while it sat idle disqualifies
+// it on reuse.
+class UpstreamPool : public IoHandler {
+private:
+    struct Idle {
+        int fd;
+        EventLoop::TimerId timer;
+    };
+
+    EventLoop& loop;
+    unordered_map<string, deque<Idle>> idle;
+    unordered_map<int, string> keys; // idle fd -> its key
+
+    UpstreamPool(EventLoop& l) : loop(l) {}
+
+    void drop(deque<Idle>& q, size_t i) {
+        loop.cancel_timer(q[i].timer);
+        keys.erase(q[i].fd);
+        loop.close(q[i].fd);
+        q.erase(q.begin() + i);
+    }
+
+public:
+    static int max_idle;        // per key; 0 disables pooling (-u)
+    static int idle_timeout_ms; // (-U)
+
+    static UpstreamPool& local(EventLoop& loop) {
+        static thread_local unique_ptr<UpstreamPool> pool;
+        if (!pool) pool.reset(new UpstreamPool(loop));
+        return *pool;
+    }
+
+    static string key(const char* host, int port) {
+        string k = host;
+        transform(k.begin(), k.end(), k.begin(), ::tolower);
+        return k + ":" + to_string(port);
+    }
+
+    // A healthy idle connection for key, or -1. One the origin has closed
+    // or sent anything on since is dropped: with io_uring what arrived may
+    // already sit in the loop's queue rather than the socket.
+    int take(const string& k) {
+        auto it = idle.find(k);
+        if (it == idle.end()) return -1;
+        deque<Idle>& q = it->second;
+        int fd = -1;
+        while (fd < 0 && !q.empty()) {
+            char c;
+            ssize_t n = loop.holds_input(q.back().fd) ? 1 : ::recv(q.back().fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                fd = q.back().fd;
+                loop.cancel_timer(q.back().timer);
+                keys.erase(fd);
+                q.pop_back();
+            } else {
+                drop(q, q.size() - 1);
+            }
+        }
+        if (q.empty()) idle.erase(it);
+        return fd;
+    }
+
+    // Parks fd, whose last response was read to its end, for reuse.
+    void give(const string& k, int fd) {
+        if (max_idle <= 0) {
+            loop.close(fd);
+            return;
+        }
+        deque<Idle>& q = idle[k];
+        if ((int)q.size() >= max_idle) drop(q, 0);
+        q.push_back({fd, loop.add_timer(idle_timeout_ms, this, fd)});
+        keys[fd] = k;
+    }
+
+    void on_io(int fd, ssize_t) override {
+        // Idle timeout
+        auto k = keys.find(fd);
+        if (k == keys.end()) return;
+        auto it = idle.find(k->second);
+        deque<Idle>& q = it->second;
+        for (size_t i = 0; i < q.size(); i++) {
+            if (q[i].fd != fd) continue;
+            keys.erase(k);
+            loop.close(fd);
+            q.erase(q.begin() + i);
+            break;
+        }
+        if (q.empty()) idle.erase(it);
+    }
+};
+
+int UpstreamPool::max_idle = UPSTREAM_MAX_IDLE;
+int UpstreamPool::idle_timeout_ms = UPSTREAM_IDLE_TIMEOUT_MS;
+
+// Shuts the read side of a client connection once it has been idle too
+// long, which completes the pending recv with EOF.
+class IdleTimer : public IoHandler {
+private:
+    EventLoop& loop;
+    int fd;
+    EventLoop::TimerId id;
+    bool armed = false;
+
+public:
+    bool fired = false;
+
+    IdleTimer(EventLoop& l, int f) : loop(l), fd(f) {}
+    ~IdleTimer() { cancel(); }
+
+    void arm(int ms) {
+        cancel();
+        id = loop.add_timer(ms, this, 0);
+        armed = true;
+    }
+
+    void cancel() {
+        if (armed) loop.cancel_timer(id);
+        armed = false;
+    }
+
+    void on_io(int, ssize_t) override {
+        armed = false;
+        fired = true;
+        shutdown(fd, SHUT_RD);
+    }
+};
+
+// ----------------------------------------------------------
+//  Client Pipeline
+// ----------------------------------------------------------
+// A client may pipeline requests. The connection's reader starts a task
+// for every complete request head it has, up to PIPELINE_DEPTH at once;
+// the tasks look up the cache and fetch misses concurrently but write to
+// the client one at a time, in request order. Each task waits for its
+// turn before its first write and passes the turn on when it is done. A
+// miss waiting for its turn has already sent its request upstream, so
+// the origin's answer queues in the socket buffers meanwhile.
+class ClientConn {
+public:
+    EventLoop& loop;
+    int fd;
+    IdleTimer idle;
+    bool closing = false; // a response ended the connection; later tasks stay silent
+    bool reading = false; // the reader is waiting for request bytes
+    int in_flight = 0;
+
+private:
+    uint64_t next_turn = 0;
+    unordered_map<uint64_t, coroutine_handle<>> turn_waiters;
+    coroutine_handle<> reader;
+    int reader_limit = 0;
+
+public:
+    ClientConn(EventLoop& l, int f) : loop(l), fd(f), idle(l, f) {}
+
+    struct TurnOp {
+        ClientConn& conn;
+        uint64_t idx;
+
+        bool await_ready() { return conn.has_turn(idx); }
+        void await_suspend(coroutine_handle<> h) { conn.turn_waiters[idx] = h; }
+        void await_resume() {}
+    };
+
+    // Resumes once request idx may write to the client.
+    TurnOp turn(uint64_t idx) { return TurnOp{*this, idx}; }
+
+    bool has_turn(uint64_t idx) const { return next_turn == idx; }
+
+    struct FlightOp {
+        ClientConn& conn;
+        int limit;
+
+        bool await_ready() { return conn.in_flight < limit; }
+        void await_suspend(coroutine_handle<> h) {
+            conn.reader = h;
+            conn.reader_limit = limit;
+        }
+        void await_resume() {}
+    };
+
+    // Reader only: resumes once fewer than limit tasks are in flight.
+    FlightOp below(int limit) { return FlightOp{*this, limit}; }
+
+    // Stops the connection after the current response; wakes the reader.
+    void end() {
+        closing = true;
+        shutdown(fd, SHUT_RD);
+    }
+
+    // Called by task idx as its last act, with its turn: passes the turn
+    // on. Whatever is resumed here may finish the connection, so nothing
+    // of it is touched afterwards.
+    void finish(uint64_t idx) {
+        in_flight--;
+        next_turn = max(next_turn, idx + 1);
+        if (in_flight == 0 && reading && !closing) idle.arm(client_idle_timeout_ms);
+        coroutine_handle<> r;
+        if (reader && in_flight < reader_limit) {
+            r = reader;
+            reader = nullptr;
+        }
+        coroutine_handle<> t;
+        auto it = turn_waiters.find(next_turn);
+        if (it != turn_waiters.end()) {
+            t = it->second;
+            turn_waiters.erase(it);
+        }
+        if (t) t.resume();
+        if (r) r.resume();
+    }
 };
 
+// ----------------------------------------------------------
+//  Request Handler
+// ----------------------------------------------------------
+// Incremental parser for an origin response head. feed() is handed all
+// the bytes received so far each time more arrive, looks only at the new
+// ones, and allocates nothing: what it learns is kept as numbers, flags
+// and offsets into the head.
+struct ResponseHead {
+    struct Span {
+        uint32_t off, len;
+    };
+    static const int MAX_DROPPED = 16; // hop-by-hop header lines
+    static const int MAX_VARY = 8;     // names across Vary headers
+
+    int status = 0;            // 0 unless the status line was HTTP/1.x
+    bool http10 = false;
+    bool conn_close = false, conn_keep_alive = false;
+    bool chunked = false;      // Transfer-Encoding includes chunked
+    bool have_length = false;
+    bool bad_length = false;   // a Content-Length that is not a number or disagrees with another
+    uint64_t length = 0;
+    bool no_store = false;     // Cache-Control: no-store or private
+    bool shared = false;       // Cache-Control: public, s-maxage or must-revalidate (RFC 9111 section 3.5)
+    bool revalidate = false;   // Cache-Control: no-cache, max-age=0 or s-maxage=0
+    bool set_cookie = false;
+    bool vary_all = false;     // Vary: *, or more names than fit
+    Span vary[MAX_VARY];
+    int vary_count = 0;
+    Span dropped[MAX_DROPPED]; // Connection, Keep-Alive and Proxy-Connection lines, line ends included
+    int dropped_count = 0;
+    bool malformed = false;    // more hop-by-hop lines than fit
+    size_t head_len = 0;       // once complete: through the blank line
 
-class LRUCache {
 private:
-    struct CacheEntry {
-        string url;
-        string data; 
-    };
+    size_t scanned = 0; // bytes looked at
+    size_t line = 0;    // start of the line being read
 
-    size_t capacity_bytes;
-    size_t current_size;
-    list<CacheEntry> lru_list; 
-    unordered_map<string, list<CacheEntry>::iterator> cache_map; 
-    mutex cache_lock; 
+    static bool is(const char* p, size_t n, const char* word) {
+        return strlen(word) == n && strncasecmp(p, word, n) == 0;
+    }
 
-public:
-    LRUCache(size_t cap) : capacity_bytes(cap), current_size(0) {}
+    // Calls f(offset, length) for each non-empty item of a comma list,
+    // without surrounding whitespace.
+    template <typename F>
+    static void items(const char* buf, size_t from, size_t to, F f) {
+        while (from < to) {
+            size_t end = from;
+            while (end < to && buf[end] != ',') end++;
+            size_t a = from, b = end;
+            while (a < b && (buf[a] == ' ' || buf[a] == '\t')) a++;
+            while (b > a && (buf[b - 1] == ' ' || buf[b - 1] == '\t')) b--;
+            if (b > a) f(a, b - a);
+            from = end + 1;
+        }
+    }
 
-    string get(string url) {
-        lock_guard<mutex> lock(cache_lock); 
-        auto it = cache_map.find(url);
-        if (it == cache_map.end()) return ""; 
-        lru_list.splice(lru_list.begin(), lru_list, it->second);
-        return it->second->data;
+    void status_line(const char* p, size_t n) {
+        if (n < 12 || strncasecmp(p, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)p[7]) || p[8] != ' ') return;
+        if (!isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) || !isdigit((unsigned char)p[11])) return;
+        status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+        http10 = p[7] == '0';
     }
 
-    void put(string url, const string& data) {
-        lock_guard<mutex> lock(cache_lock);
-        size_t entry_size = url.size() + data.size();
-        if (entry_size > capacity_bytes) return;
+    // A header line of n bytes at from, line end excluded; full includes it.
+    void header(const char* buf, size_t from, size_t n, size_t full) {
+        const char* p = buf + from;
+        const char* colon = (const char*)memchr(p, ':', n);
+        if (!colon) return;
+        size_t name_len = colon - p;
+        size_t value = colon + 1 - buf, end = from + n;
 
-        if (cache_map.find(url) != cache_map.end()) {
-            auto it = cache_map[url];
-            current_size -= (it->url.size() + it->data.size());
-            lru_list.erase(it);
-            cache_map.erase(url);
+        if (is(p, name_len, "connection") || is(p, name_len, "keep-alive") || is(p, name_len, "proxy-connection")) {
+            if (dropped_count == MAX_DROPPED) {
+                malformed = true;
+                return;
+            }
+            dropped[dropped_count++] = {(uint32_t)from, (uint32_t)full};
+            if (!is(p, name_len, "connection")) return;
+            items(buf, value, end, [&](size_t off, size_t len) {
+                if (is(buf + off, len, "close")) conn_close = true;
+                if (is(buf + off, len, "keep-alive")) conn_keep_alive = true;
+            });
+        } else if (is(p, name_len, "transfer-encoding")) {
+            items(buf, value, end, [&](size_t off, size_t len) {
+                if (is(buf + off, len, "chunked")) chunked = true;
+            });
+        } else if (is(p, name_len, "content-length")) {
+            items(buf, value, end, [&](size_t off, size_t len) {
+                uint64_t n = 0;
+                bool number = len <= 18;
+                for (size_t i = 0; number && i < len; i++) {
+                    number = isdigit((unsigned char)buf[off + i]);
+                    n = n * 10 + (buf[off + i] - '0');
+                }
+                if (!number || (have_length && n != length)) bad_length = true;
+                have_length = true;
+                length = n;
+            });
+        } else if (is(p, name_len, "cache-control")) {
+            items(buf, value, end, [&](size_t off, size_t len) {
+                const char* eq = (const char*)memchr(buf + off, '=', len);
+                size_t directive = eq ? eq - (buf + off) : len;
+                if (is(buf + off, directive, "no-store") || is(buf + off, directive, "private")) no_store = true;
+                if (is(buf + off, directive, "public") || is(buf + off, directive, "s-maxage")
+                        || is(buf + off, directive, "must-revalidate")) {
+                    shared = true;
+                }
+                if (is(buf + off, directive, "no-cache")) revalidate = true;
+                if (eq && (is(buf + off, directive, "max-age") || is(buf + off, directive, "s-maxage"))) {
+                    size_t a = directive + 1, b = len;
+                    if (b - a >= 2 && buf[off + a] == '"' && buf[off + b - 1] == '"') a++, b--;
+                    bool zero = a < b;
+                    for (size_t i = a; zero && i < b; i++) zero = buf[off + i] == '0';
+                    if (zero) revalidate = true;
+                }
+            });
+        } else if (is(p, name_len, "set-cookie")) {
+            set_cookie = true;
+        } else if (is(p, name_len, "vary")) {
+            items(buf, value, end, [&](size_t off, size_t len) {
+                if (len == 1 && buf[off] == '*') vary_all = true;
+                else if (vary_count == MAX_VARY) vary_all = true;
+                else vary[vary_count++] = {(uint32_t)off, (uint32_t)len};
+            });
         }
+    }
 
-        while (current_size + entry_size > capacity_bytes && !lru_list.empty()) {
-            auto last = lru_list.back();
-            current_size -= (last.url.size() + last.data.size());
-            cache_map.erase(last.url);
-            lru_list.pop_back();
+public:
+    // True once buf, n bytes of response so far, holds the whole head.
+    bool feed(const char* buf, size_t n) {
+        while (head_len == 0 && scanned < n) {
+            const char* nl = (const char*)memchr(buf + scanned, '\n', n - scanned);
+            if (!nl) {
+                scanned = n;
+                break;
+            }
+            size_t next = nl - buf + 1;
+            size_t len = next - line - 1;
+            if (len > 0 && buf[line + len - 1] == '\r') len--;
+            if (line == 0) {
+                status_line(buf, len);
+            } else if (len == 0) {
+                head_len = next; // a blank line, CRLF or bare LF (RFC 9112 section 2.2)
+            } else {
+                header(buf, line, len, next - line);
+            }
+            line = scanned = next;
         }
+        return head_len > 0;
+    }
 
-        lru_list.push_front({url, data});
-        cache_map[url] = lru_list.begin();
-        current_size += entry_size;
+    // Removes the hop-by-hop lines (how long the client connection lives
+    // is up to the proxy) from the complete head at the start of buf, in
+    // place, and makes a bare LF blank line CRLF so headIov() can put a
+    // line before it. Returns the head's new length; offsets into the
+    // head no longer hold.
+    size_t strip(string& buf) const {
+        size_t out = head_len;
+        if (dropped_count > 0) {
+            char* p = &buf[0];
+            out = dropped[0].off;
+            for (int i = 0; i < dropped_count; i++) {
+                size_t from = dropped[i].off + dropped[i].len;
+                size_t to = i + 1 < dropped_count ? dropped[i + 1].off : head_len;
+                memmove(p + out, p + from, to - from);
+                out += to - from;
+            }
+            buf.erase(out, head_len - out);
+        }
+        if (out < 2 || buf[out - 2] != '\r') {
+            buf.insert(out - 1, 1, '\r');
+            out++;
+        }
+        return out;
     }
 };
 
-// Global State
-int port_number = 8080;
-int proxy_socketId;
-sem_t seamaphore;
-LRUCache cache(MAX_CACHE_SIZE);
-
+// Decides from the parsed response head whether the body is worth
+// capturing for the cache: only 200s that allow storing and do not vary on
+// everything, and for a request with credentials (authorized) only those
+// marked fit to share. The cache neither expires nor revalidates what it
+// holds, so a response that must be revalidated before reuse, or sets a
+// cookie, is not kept either. vary gets the request headers named by its Vary
+// headers, from the unstripped head. Size is checked by the caller.
+bool responseCacheable(const ResponseHead& h, const char* head, bool authorized, vector<string>& vary) {
+    if (h.status != 200 || h.no_store || h.vary_all || (authorized && !h.shared)) return false;
+    if (h.revalidate || h.set_cookie) return false;
+    vary.clear();
+    for (int i = 0; i < h.vary_count; i++) {
+        string name(head + h.vary[i].off, h.vary[i].len);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (find(vary.begin(), vary.end(), name) == vary.end()) vary.push_back(name);
+    }
+    sort(vary.begin(), vary.end());
+    return true;
+}
 
-int send_all(int socket, const char* buffer, size_t length) {
-    size_t total_sent = 0;
-    while (total_sent < length) {
-        ssize_t sent = send(socket, buffer + total_sent, length - total_sent, MSG_NOSIGNAL);
-        if (sent == -1) {
-            if (errno == EINTR) continue; // Interrupted by signal, retry
-            return -1; // Real error
+// Whether an HTTP/1.1 client wants its connection kept open after this
+// request; HTTP/1.0 clients get one response per connection.
+bool clientKeepAlive(const string& req) {
+    size_t line_end = req.find("\r\n");
+    if (line_end < 8 || req.compare(line_end - 8, 8, "HTTP/1.1") != 0) return false;
+    for (size_t line = line_end + 2; line < req.size(); ) {
+        size_t next = req.find("\r\n", line);
+        if (next == string::npos || next == line) break;
+        if (strncasecmp(req.c_str() + line, "connection:", 11) == 0) {
+            string value = req.substr(line + 11, next - line - 11);
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (value.find("close") != string::npos) return false;
         }
-        total_sent += sent;
+        line = next + 2;
     }
-    return 0;
+    return true;
+}
+
+// Points iov at a response head ending in its blank line, adding
+// Connection: close when the client connection ends after this response.
+int headIov(struct iovec* iov, const char* head, size_t head_len, bool close) {
+    static const char CLOSE[] = "Connection: close\r\n\r\n";
+    iov[0].iov_base = (void*)head;
+    iov[0].iov_len = close ? head_len - 2 : head_len;
+    if (!close) return 1;
+    iov[1].iov_base = (void*)CLOSE;
+    iov[1].iov_len = sizeof(CLOSE) - 1;
+    return 2;
+}
+
+// Sends bytes [from, to) of a response held in memory as head_len bytes of
+// head then body; the head goes out through headIov().
+Co<int> send_stored(EventLoop& loop, int fd, const char* data, size_t head_len, size_t from, size_t to, bool close) {
+    struct iovec iov[3];
+    int cnt = 0;
+    if (from == 0 && to > 0) {
+        cnt = headIov(iov, data, head_len, close);
+        from = head_len;
+    }
+    if (to > from) {
+        iov[cnt].iov_base = (void*)(data + from);
+        iov[cnt].iov_len = to - from;
+        cnt++;
+    }
+    if (cnt == 0) co_return 0;
+    co_return co_await async_sendv_all(loop, fd, iov, cnt) < 0 ? -1 : 0;
 }
 
+// Tracks where an origin response ends, so its connection can go back to
+// the pool: from the parsed head it takes the framing (no body,
+// Content-Length, chunked, or until close) and whether the origin keeps
+// the connection open, then it counts or scans body bytes as they pass.
+struct ResponseFrame {
+    enum Mode { NO_BODY, LENGTH, CHUNKED, UNTIL_CLOSE };
+    enum Chunk { SIZE, EXT, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, FINAL_LF, DONE };
 
-int connectRemoteServer(char* host_addr, int port_num) {
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (remoteSocket < 0) return -1;
+    Mode mode = UNTIL_CLOSE;
+    bool keep_alive = false;
+    uint64_t remaining = 0; // LENGTH: body bytes left; CHUNKED: of this chunk
+    Chunk chunk = SIZE;
 
-    struct hostent *host = gethostbyname(host_addr);
-    if (host == NULL) {
-        close(remoteSocket); // FIX: Close FD on failure
-        return -1;
+    // Sets the framing from a complete head.
+    void start(const ResponseHead& h) {
+        if (h.status < 200) return; // garbage or an interim response: relay until close
+        keep_alive = h.conn_close ? false : h.conn_keep_alive || !h.http10;
+        if (h.status == 204 || h.status == 304) {
+            mode = NO_BODY;
+        } else if (h.chunked) {
+            mode = CHUNKED;
+        } else if (h.have_length && !h.bad_length) {
+            mode = LENGTH;
+            remaining = h.length;
+        } else {
+            keep_alive = false;
+        }
     }
 
-    struct sockaddr_in server_addr;
-    bzero((char*)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-    bcopy((char *)host->h_addr, (char *)&server_addr.sin_addr.s_addr, host->h_length);
+    bool done() const {
+        return mode == NO_BODY || (mode == LENGTH && remaining == 0) || (mode == CHUNKED && chunk == DONE);
+    }
+
+    // Accounts for n bytes read after the head and returns how many of
+    // them belong to the body. Bytes past the end make the connection
+    // unusable and are not part of the response; a malformed chunk makes
+    // the relay run until close.
+    size_t consume(const char* p, size_t n) {
+        if (mode == LENGTH) {
+            if (n > remaining) keep_alive = false;
+            n = min<uint64_t>(n, remaining);
+            remaining -= n;
+            return n;
+        }
+        if (mode != CHUNKED) {
+            if (n > 0 && mode == NO_BODY) keep_alive = false;
+            return mode == NO_BODY ? 0 : n;
+        }
+        for (size_t i = 0; i < n; i++) {
+            char c = p[i];
+            switch (chunk) {
+            case SIZE:
+                if (isxdigit((unsigned char)c) && remaining < (1ULL << 56)) {
+                    remaining = remaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    chunk = EXT;
+                } else if (c == '\r') {
+                    chunk = SIZE_LF;
+                } else {
+                    return broken(n);
+                }
+                break;
+            case EXT:
+                if (c == '\r') chunk = SIZE_LF;
+                break;
+            case SIZE_LF:
+                if (c != '\n') return broken(n);
+                chunk = remaining ? DATA : TRAILER;
+                break;
+            case DATA: {
+                uint64_t take = min<uint64_t>(remaining, n - i);
+                remaining -= take;
+                i += take - 1;
+                if (remaining == 0) chunk = DATA_CR;
+                break;
+            }
+            case DATA_CR:
+                if (c != '\r') return broken(n);
+                chunk = DATA_LF;
+                break;
+            case DATA_LF:
+                if (c != '\n') return broken(n);
+                chunk = SIZE;
+                break;
+            case TRAILER:
+                chunk = (c == '\r') ? FINAL_LF : TRAILER_LINE;
+                break;
+            case TRAILER_LINE:
+                if (c == '\n') chunk = TRAILER;
+                break;
+            case FINAL_LF:
+                if (c != '\n') return broken(n);
+                chunk = DONE;
+                break;
+            case DONE:
+                keep_alive = false; // bytes after the last chunk
+                return i;
+            }
+        }
+        return n;
+    }
+
+    size_t broken(size_t n) {
+        mode = UNTIL_CLOSE;
+        keep_alive = false;
+        return n;
+    }
+};
+
+// The request to forward, as an edit list over the client's raw bytes: the
+// request line with its absolute URI cut down to the path, every header
+// except Host and Connection, then our own Host and Connection lines.
+// Adjacent kept ranges merge, so this is a handful of iovecs.
+struct ForwardRequest {
+    static const int MAX_PIECES = 16;
+
+    struct iovec iov[MAX_PIECES];
+    int count = 0;
+
+    bool add(const char* p, size_t n) {
+        if (n == 0) return true;
+        if (count > 0 && (const char*)iov[count - 1].iov_base + iov[count - 1].iov_len == p) {
+            iov[count - 1].iov_len += n;
+            return true;
+        }
+        if (count == MAX_PIECES) return false;
+        iov[count].iov_base = (void*)p;
+        iov[count].iov_len = n;
+        count++;
+        return true;
+    }
+
+    // raw_req must already have parsed as a request for host. False if it
+    // needs more pieces than fit.
+    bool build(const string& raw_req, const char* host, bool keep_alive) {
+        static const char HOST_PREFIX[] = "Host: ";
+        static const char CLOSE[] = "\r\nConnection: close\r\n\r\n";
+        static const char KEEP_ALIVE[] = "\r\nConnection: keep-alive\r\n\r\n";
+        const char* p = raw_req.data();
+        size_t line_end = raw_req.find("\r\n");
+        size_t head_end = raw_req.find("\r\n\r\n");
 
-    if (connect(remoteSocket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(remoteSocket); // Ensure close on connect fail too
-        return -1;
+        // "GET http://host[:port]/path HTTP/1.x" -> "GET /path HTTP/1.x"
+        size_t uri = raw_req.find(' ') + 1;
+        size_t path = raw_req.find('/', raw_req.find("://", uri) + 3);
+        if (!add(p, uri) || !add(p + path, line_end + 2 - path)) return false;
+
+        for (size_t line = line_end + 2; line < head_end + 2; ) {
+            size_t next = raw_req.find("\r\n", line) + 2;
+            bool drop = strncasecmp(p + line, "host:", 5) == 0 || strncasecmp(p + line, "connection:", 11) == 0;
+            if (!drop && !add(p + line, next - line)) return false;
+            line = next;
+        }
+        return add(HOST_PREFIX, sizeof(HOST_PREFIX) - 1) && add(host, strlen(host))
+            && (keep_alive ? add(KEEP_ALIVE, sizeof(KEEP_ALIVE) - 1) : add(CLOSE, sizeof(CLOSE) - 1));
+    }
+};
+
+// Turns %XX escapes of unreserved characters into the characters and
+// writes the hex digits of the others in upper case (RFC 3986 6.2.2).
+static void appendPercentNormalized(string& out, const char* p, size_t n) {
+    static const char HEX[] = "0123456789ABCDEF";
+    auto digit = [](char c) { return isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10; };
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != '%' || i + 2 >= n || !isxdigit((unsigned char)p[i + 1]) || !isxdigit((unsigned char)p[i + 2])) {
+            out += p[i];
+            continue;
+        }
+        int v = digit(p[i + 1]) << 4 | digit(p[i + 2]);
+        if (isalnum(v) || v == '-' || v == '.' || v == '_' || v == '~') {
+            out += (char)v;
+        } else {
+            out += '%';
+            out += HEX[v >> 4];
+            out += HEX[v & 15];
+        }
+        i += 2;
     }
-    return remoteSocket;
 }
 
-int sendErrorMessage(int socket, int status_code) {
-    char str[1024];
-    string currentTime;
-    time_t now = time(0);
-    struct tm data = *gmtime(&now);
-    char timebuf[128];
-    strftime(timebuf, sizeof(timebuf), "%a, %d %b %Y %H:%M:%S %Z", &data);
-    
-    string msg;
-    switch(status_code) {
-        case 400: msg = "400 Bad Request"; break;
-        case 500: msg = "500 Internal Server Error"; break;
-        case 501: msg = "501 Not Implemented"; break;
-        default: msg = "500 Internal Server Error"; break;
+// Resolves "." and ".." segments of an absolute path (RFC 3986 5.2.4).
+static string removeDotSegments(const string& path) {
+    string out;
+    for (size_t i = 0; i < path.size(); ) {
+        size_t j = path.find('/', i + 1);
+        if (j == string::npos) j = path.size();
+        size_t len = j - i - 1; // segment after the slash at i
+        bool last = j == path.size();
+        if (len == 1 && path[i + 1] == '.') {
+            if (last) out += '/';
+        } else if (len == 2 && path[i + 1] == '.' && path[i + 2] == '.') {
+            size_t k = out.rfind('/');
+            out.resize(k == string::npos ? 0 : k);
+            if (last) out += '/';
+        } else {
+            out.append(path, i, j - i);
+        }
+        i = j;
     }
-    snprintf(str, sizeof(str), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\nDate: %s\r\n\r\n", status_code, msg.c_str(), timebuf);
-    send_all(socket, str, strlen(str));
-    return 1;
+    return out.empty() ? "/" : out;
 }
 
-// ----------------------------------------------------------
-//  Request Handler
-// ----------------------------------------------------------
-int handle_request(int clientSocket, ParsedRequest *request, string url) {
-    // 1. Reconstruct Request (Robust Header Forwarding)
-    string req_str = string(request->method) + " " + string(request->path) + " " + string(request->version) + "\r\n";
+// The cache key of a parsed request: "METHOD scheme://host:port/path?query"
+// with the scheme and host in lower case, the port always spelled out,
+// escapes normalized and dot segments removed from the path. The request's
+// headers play no part, so every client asking for a URL shares its entry;
+// that is why requests with credentials bypass the cache (see
+// serve_request) and only responses that Vary on a header are told apart.
+CacheKey cacheKey(ParsedRequest* request) {
+    CacheKey key;
+    string& k = key.text;
+    string scheme = request->protocol;
+    string host = request->host;
+    transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+    transform(host.begin(), host.end(), host.begin(), ::tolower);
+    if (!host.empty() && host.back() == '.') host.pop_back();
+    int port = request->port ? atoi(request->port) : (scheme == "https" ? 443 : 80);
+
+    const char* target = request->path;
+    size_t target_len = strcspn(target, "#");
+    size_t path_len = strcspn(target, "?#");
+    string path;
+    appendPercentNormalized(path, target, path_len);
+
+    k.reserve(strlen(request->method) + scheme.size() + host.size() + target_len + 16);
+    k.append(request->method).append(" ").append(scheme).append("://").append(host);
+    k.append(":").append(to_string(port)).append(removeDotSegments(path));
+    appendPercentNormalized(k, target + path_len, target_len - path_len);
+    key.hash = hash<string>()(k);
+    return key;
+}
+
+// A request's values for the headers a response varies on, one line per
+// name in order, "=value" (trimmed) if the request has the header and
+// empty if not. Two requests get the same variant when these match.
+string varySelector(ParsedRequest* request, const vector<string>& names) {
+    string out;
+    for (const string& name : names) {
+        for (size_t i = 0; i < request->headersused; i++) {
+            const ParsedHeader& h = request->headers[i];
+            if (!h.key || strcasecmp(h.key, name.c_str()) != 0) continue;
+            const char* a = h.value;
+            const char* b = h.value + strlen(h.value);
+            while (a < b && (*a == ' ' || *a == '\t')) a++;
+            while (b > a && (b[-1] == ' ' || b[-1] == '\t')) b--;
+            out.append("=").append(a, b - a);
+            break;
+        }
+        out += '\n';
+    }
+    return out;
+}
 
-    for (size_t i = 0; i < request->headersused; i++) {
-        string key(request->headers[i].key);
-        string value(request->headers[i].value);
-        
-        // Fix F: Case-insensitive comparison
-        string key_lower = key;
-        transform(key_lower.begin(), key_lower.end(), key_lower.begin(), ::tolower);
+// Moves the rest of an uncached response from the origin to the client
+// through a pipe, so the payload never enters user space. Stops after
+// limit bytes, or at EOF if there is no limit (EOF short of a limit is an
+// error).
+Co<int> splice_relay(EventLoop& loop, int client_fd, int remote_fd, uint64_t limit = UINT64_MAX) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) co_return -1;
 
-        if (key_lower == "host" || key_lower == "connection") continue;
-        
-        req_str += key + ": " + value + "\r\n";
+    int status = 0;
+    while (status == 0 && limit > 0) {
+        ssize_t n = co_await async_splice(loop, remote_fd, pipefd[1], min<uint64_t>(SPLICE_CHUNK, limit), false);
+        if (n <= 0) {
+            if (n < 0 || limit != UINT64_MAX) status = -1;
+            break;
+        }
+        if (limit != UINT64_MAX) limit -= n;
+        while (n > 0) {
+            ssize_t m = co_await async_splice(loop, client_fd, pipefd[0], n, true);
+            if (m <= 0) {
+                status = -1;
+                break;
+            }
+            n -= m;
+        }
     }
-    
-    req_str += "Host: " + string(request->host) + "\r\n";
-    req_str += "Connection: close\r\n\r\n";
+    ::close(pipefd[0]);
+    ::close(pipefd[1]);
+    co_return status;
+}
+
+// Forwards a parsed GET to the origin and relays the response. Returns 0
+// once the response is relayed, -1 if the relay broke off part way, or a
+// status code for the caller to send back. A connection whose response
+// was read to its end goes back to the upstream pool. persistent says
+// whether the client connection may carry another request; keep_client
+// is whether it was going to. Nothing is written to the client before
+// request idx has its turn.
+Co<int> handle_request(EventLoop& loop, ClientConn& conn, uint64_t idx, int& remote_fd, ParsedRequest* request,
+                       const string& raw_req, const CacheKey& cache_key, const shared_ptr<Fetch>& fetch, bool keep_client,
+                       bool& persistent) {
+    int client_fd = conn.fd;
+    persistent = false;
+    UpstreamPool& pool = UpstreamPool::local(loop);
+    bool pooling = UpstreamPool::max_idle > 0;
+
+    // 1. Edit the client's request in place (Robust Header Forwarding)
+    ForwardRequest fwd;
+    if (!fwd.build(raw_req, request->host, pooling)) co_return 400;
 
-    // 2. Connect to Remote
     int server_port = 80;
     if (request->port != NULL) server_port = atoi(request->port);
-    int remoteSocketID = connectRemoteServer(request->host, server_port);
-    if (remoteSocketID < 0) return -1;
+    string key = UpstreamPool::key(request->host, server_port);
+
+    // 2. Reuse an idle connection, or resolve and connect (Happy Eyeballs,
+    // bounded by the connect deadline), then send the request and wait for
+    // the first bytes. A pooled connection the origin dropped in the
+    // meantime is retried on a fresh one; nothing has reached the client.
+    PooledBuffer relay(BufferPool::RELAY);
+    ssize_t n;
+    while (1) {
+        int fd = pool.take(key);
+        bool reused = fd >= 0;
+        if (!reused) {
+            ResolveOp dns(loop, request->host, server_port);
+            co_await dns;
+            if (dns.status != 0) co_return 502;
+            fd = co_await ConnectOp(loop, dns.addrs, connect_timeout_ms);
+            if (fd < 0) co_return fd == -ETIMEDOUT ? 504 : 502;
+        }
+        remote_fd = fd;
 
-    // 3. Send Request
-    if (send_all(remoteSocketID, req_str.c_str(), req_str.size()) < 0) {
-        close(remoteSocketID);
-        return -1;
+        struct iovec iov[ForwardRequest::MAX_PIECES];
+        memcpy(iov, fwd.iov, sizeof(iov[0]) * fwd.count);
+        n = co_await async_sendv_all(loop, remote_fd, iov, fwd.count);
+        if (n >= 0) n = co_await async_recv(loop, remote_fd, relay.data(), relay.size());
+        if (n > 0) break;
+        if (!reused) co_return 502;
+        loop.close(remote_fd);
+        remote_fd = -1;
     }
 
-    // 4. Relay Response & Capture for Cache
-    string temp_cache_data;
-    vector<char> buffer(MAX_BYTES);
-    ssize_t bytes_received; // Use ssize_t for recv return
+    // 3. Relay Response & Capture for Cache. The response is read into the
+    // fetch's body whether or not this request may write yet, so followers
+    // never wait on this client; it is written out as soon as this
+    // request's turn comes. The head is held back until it is complete so
+    // the origin's hop-by-hop headers can be replaced. Once the response
+    // turns out not to be cacheable the followers are let go and the rest
+    // is relayed straight through, with splice() unless it is chunked (so
+    // its end can be found)
+    string& data = fetch->body->data;
+    ResponseHead parsed;
+    ResponseFrame frame;
+    size_t head_len = 0;
+    bool caching = true;
+    bool streaming = false; // followers may send data as it lands
+    bool writing = false;   // this request has its turn
+    bool client_ok = true;  // ...and the client is still taking the response
+    size_t sent = 0;        // bytes of data already written to the client
+    while (1) {
+        // Once the head is in, anything the origin sends past the body is dropped
+        if (head_len > 0) n = frame.consume(relay.data(), n);
+        if (head_len == 0 || caching) {
+            if (streaming) n = min((size_t)n, data.capacity() - data.size()); // never past the reservation
+            data.append(relay.data(), n);
+        } else if (n > 0) {
+            if (co_await async_send_all(loop, client_fd, relay.data(), n) < 0) co_return -1;
+        }
+        if (head_len == 0) {
+            bool complete = parsed.feed(data.data(), data.size());
+            if (parsed.malformed || (!complete && data.size() >= MAX_HEADER_SIZE)) co_return 502;
+            if (complete) {
+                frame.start(parsed);
+                persistent = keep_client && frame.mode != ResponseFrame::UNTIL_CLOSE;
+                bool cacheable = responseCacheable(parsed, data.data(), ParsedHeader_get(request, "Authorization") != NULL,
+                                                   fetch->body->vary);
+                head_len = parsed.strip(data);
+                bool too_large = frame.mode == ResponseFrame::LENGTH && frame.remaining > cache.max_object();
+                data.resize(head_len + frame.consume(data.data() + head_len, data.size() - head_len));
+                if (!cacheable) {
+                    caching = false;
+                } else if (too_large) {
+                    caching = false; // declared too large: never buffered
+                    cache.count_oversize();
+                } else if (frame.mode == ResponseFrame::LENGTH) {
+                    data.reserve(data.size() + frame.remaining);
+                    fetch->body->head_len = head_len;
+                    fetch->body->framed = true;
+                    streaming = true;
+                }
+                if (caching) fetch->body->selector = varySelector(request, fetch->body->vary);
+            }
+        }
+        if (caching && !streaming && head_len > 0 && data.size() - head_len > cache.max_object()) {
+            caching = false; // outgrew the cap: what was buffered goes out and the rest streams
+            cache.count_oversize();
+        }
+        if (streaming) fetch->update(Fetch::STREAMING, data.size());
+
+        if (head_len > 0 && !caching && !writing) {
+            // Not for the cache after all: the followers fetch their own
+            cache.end_fetch(cache_key, fetch, Fetch::ABANDONED);
+            co_await conn.turn(idx);
+            writing = true;
+            if (conn.closing) co_return -1;
+        }
+        if (head_len > 0 && client_ok && (writing || conn.has_turn(idx))) {
+            writing = true;
+            client_ok = !conn.closing
+                && co_await send_stored(loop, client_fd, data.data(), head_len, sent, data.size(), !persistent) == 0;
+            sent = data.size();
+        }
+        if (head_len > 0 && !caching) {
+            if (!client_ok) co_return -1;
+            string().swap(data);
+        }
+
+        if (head_len > 0 && frame.done()) break;
+        if (!caching && frame.mode != ResponseFrame::CHUNKED) {
+            uint64_t limit = frame.mode == ResponseFrame::LENGTH ? frame.remaining : UINT64_MAX;
+            if (co_await splice_relay(loop, client_fd, remote_fd, limit) < 0) co_return -1;
+            frame.remaining = 0;
+            break;
+        }
 
-    while ((bytes_received = recv(remoteSocketID, buffer.data(), MAX_BYTES, 0)) > 0) {
-        if (send_all(clientSocket, buffer.data(), (size_t)bytes_received) < 0) break;
-        temp_cache_data.append(buffer.data(), bytes_received);
+        n = co_await async_recv(loop, remote_fd, relay.data(), relay.size());
+        if (n <= 0 && head_len == 0) co_return 502; // nothing has reached the client yet
+        if (n < 0) co_return -1;
+        if (n == 0) {
+            if (frame.mode != ResponseFrame::UNTIL_CLOSE) co_return -1; // cut short
+            break;
+        }
+    }
+    if (frame.keep_alive && frame.done() && pooling) {
+        pool.give(key, remote_fd);
+        remote_fd = -1;
     }
+    if (!caching) co_return 0;
 
-    // 5. Store in Cache
-    cache.put(url, temp_cache_data);
-    
-    // Graceful shutdown logic (optional but recommended)
-    shutdown(remoteSocketID, SHUT_RDWR);
-    close(remoteSocketID);
-    return 0;
+    // 4. Store in Cache (CPU-side; may be stolen by another worker), which
+    // also hands the whole body to followers still waiting for it
+    fetch->body->size = data.size();
+    fetch->body->head_len = head_len;
+    fetch->body->framed = frame.mode != ResponseFrame::UNTIL_CLOSE;
+    co_await ScheduleOp();
+    cache.end_fetch(cache_key, fetch, Fetch::DONE);
+    co_await ResumeOn{loop};
+
+    // Earlier pipelined responses go first
+    if (client_ok && !writing) {
+        co_await conn.turn(idx);
+        client_ok = !conn.closing
+            && co_await send_stored(loop, client_fd, data.data(), head_len, 0, data.size(), !persistent) == 0;
+    }
+    if (!client_ok) persistent = false;
+    co_return client_ok ? 0 : -1;
+}
+
+const int FETCH_ALONE = -2;
+
+// Answers a request from another request's fetch of the same response
+// (see Fetch), once this request's turn comes. FETCH_ALONE if the fetch
+// was let go or failed before anything was written, or its response
+// varies on headers this request does not share: the caller then
+// fetches on its own.
+Co<int> follow_fetch(EventLoop& loop, ClientConn& conn, uint64_t idx, ParsedRequest* request, Fetch& fetch,
+                     bool keep_client, bool& keep_alive) {
+    keep_alive = false;
+    const CacheBody& body = *fetch.body;
+    size_t sent = 0;
+    bool writing = false;
+    while (1) {
+        FetchOp op(loop, fetch, sent);
+        co_await op;
+        if (op.state == Fetch::ABANDONED || op.state == Fetch::FAILED) {
+            if (writing) co_return -1; // cut short
+            co_return op.state == Fetch::FAILED && fetch.status > 0 ? fetch.status : FETCH_ALONE;
+        }
+        if (!writing) {
+            if (!body.vary.empty() && varySelector(request, body.vary) != body.selector) {
+                co_return FETCH_ALONE; // a variant for other request headers
+            }
+            co_await conn.turn(idx);
+            if (conn.closing) co_return -1;
+            writing = true;
+            keep_alive = keep_client && body.framed;
+        }
+        if (co_await send_stored(loop, conn.fd, op.base, body.head_len, sent, op.avail, !keep_alive) < 0) {
+            keep_alive = false;
+            co_return -1;
+        }
+        sent = op.avail;
+        if (op.state == Fetch::DONE) co_return 0;
+    }
 }
 
 // ----------------------------------------------------------
-//  Thread Function
+//  Client Connection (one coroutine per connection)
 // ----------------------------------------------------------
-void* thread_fn(void* socketNew) {
-    // 1. Semaphore Admission
-    sem_wait(&seamaphore);
-    
-    SemGuard guard(&seamaphore); 
+// Answers request idx of a client connection: a hit from the cache, a
+// miss from the origin (or from a fetch of it already under way), or an
+// error, written when the request's turn comes. Ends the connection if
+// the response was its last.
+Detached serve_request(ClientConn& conn, uint64_t idx, const char* head, size_t head_len, bool keep_client) {
+    EventLoop& loop = conn.loop;
+    int client_fd = conn.fd;
+    PooledString req;
+    string& raw_req = req.str();
+    raw_req.assign(head, head_len);
+    int remote_fd = -1;
+    int status = 0;          // error response to send, if any
+    bool keep_alive = false; // the connection may carry another request
+    conn.in_flight++;
 
-    int socket = *(int*)socketNew;
-    delete (int*)socketNew;
+    // Parsing and cache lookup are CPU-side; may be stolen by another worker
+    co_await ScheduleOp();
+    ParsedRequest* request = ParsedRequest_create();
+    CacheKey key;
+    if (ParsedRequest_parse(request, raw_req.c_str(), raw_req.size()) < 0) {
+        status = 400;
+    } else if (string(request->method) != "GET") {
+        status = 501;
+    } else {
+        key = cacheKey(request);
+    }
+    shared_ptr<Fetch> fetch;
+    bool leader = false;
+    shared_ptr<const CacheBody> hit;
+    if (status == 0 && ParsedHeader_get(request, "Authorization") != NULL) {
+        // The answer may be for these credentials only: neither served from
+        // the cache nor shared with other misses, and stored only if the
+        // origin says it may be (see responseCacheable)
+        fetch = make_shared<Fetch>();
+        leader = true;
+    } else if (status == 0) {
+        hit = cache.get(key, [request](const vector<string>& names) { return varySelector(request, names); }, fetch,
+                        leader);
+    }
+    co_await ResumeOn{loop};
 
-    // Fix D: Detach thread to prevent resource leaks
-    pthread_detach(pthread_self()); 
+    if (hit) {
+        // HIT: the shared body stays alive until this send is done
+        co_await conn.turn(idx);
+        keep_alive = keep_client && hit->framed && !conn.closing;
+        bool close = !keep_alive && hit->head_len > 0;
+        if (conn.closing) {
+            // an earlier response ended the connection
+        } else if (hit->fd >= 0) {
+            if (!close) {
+                if (co_await async_sendfile_all(loop, client_fd, hit->fd, 0, hit->size) < 0) keep_alive = false;
+            } else {
+                struct iovec iov[2];
+                headIov(iov, NULL, hit->head_len, true);
+                if (co_await async_sendfile_all(loop, client_fd, hit->fd, 0, iov[0].iov_len) >= 0
+                        && co_await async_sendv_all(loop, client_fd, &iov[1], 1) >= 0) {
+                    co_await async_sendfile_all(loop, client_fd, hit->fd, hit->head_len, hit->size - hit->head_len);
+                }
+            }
+        } else {
+            struct iovec iov[3];
+            int cnt = close ? headIov(iov, hit->data.data(), hit->head_len, true) : 0;
+            iov[cnt].iov_base = (void*)(hit->data.data() + (close ? hit->head_len : 0));
+            iov[cnt].iov_len = hit->data.size() - (close ? hit->head_len : 0);
+            if (co_await async_sendv_all(loop, client_fd, iov, cnt + 1) < 0) keep_alive = false;
+        }
+        hit.reset();
+        cout << "Data retrieved from the Cache" << endl;
+    } else if (status == 0) {
+        if (!leader) {
+            // MISS already being fetched: follow it
+            status = co_await follow_fetch(loop, conn, idx, request, *fetch, keep_client, keep_alive);
+            if (status == FETCH_ALONE) {
+                fetch = make_shared<Fetch>(); // not shared with anyone
+                leader = true;
+                status = 0;
+            }
+        }
+        if (leader) {
+            // MISS
+            status = co_await handle_request(loop, conn, idx, remote_fd, request, raw_req, key, fetch, keep_client,
+                                             keep_alive);
+        }
+    }
+    ParsedRequest_destroy(request);
+    if (leader) cache.end_fetch(key, fetch, Fetch::FAILED, status); // no-op unless it ended early
+    if (status != 0) keep_alive = false; // an error or a response cut short ends the connection
 
-    // Fix C: Robust Header Accumulation
-    string raw_req;
-    vector<char> buffer(MAX_BYTES);
-    size_t total_bytes = 0;
-    bool header_complete = false;
-    const size_t MAX_HEADER_SIZE = 64 * 1024; // 64KB Safety Limit
+    if (remote_fd >= 0) {
+        shutdown(remote_fd, SHUT_RDWR);
+        loop.close(remote_fd);
+    }
+    // Even a request that failed before writing anything waits for its
+    // turn: ending the connection any earlier would cut off the responses
+    // still going out ahead of it.
+    co_await conn.turn(idx);
+    if (status > 0 && !conn.closing) {
+        string msg = buildErrorMessage(status);
+        co_await async_send_all(loop, client_fd, msg.data(), msg.size());
+    }
+    if (!keep_alive && !conn.closing) conn.end();
+    conn.finish(idx);
+}
 
-    while(total_bytes < MAX_HEADER_SIZE) {
-        ssize_t recved = recv(socket, buffer.data(), MAX_BYTES, 0);
-        if (recved <= 0) break; 
+// Reads requests from one client connection and starts a task for each,
+// until the client closes it, goes idle for client_idle_timeout_ms, asks
+// to close, or has sent client_max_requests, or a response ends it.
+Detached handle_client(EventLoop& loop, int client_fd, ConnectionOwner* owner) {
+    PooledBuffer buffer(BufferPool::HEADER);
+    PooledString req;
+    string& pending = req.str(); // request bytes not yet handed to a task
+    ClientConn conn(loop, client_fd);
+    int status = 0; // error response to send, if any
+    uint64_t served = 0;
+    bool more = true;
 
-        raw_req.append(buffer.data(), recved);
-        total_bytes += recved; // Increment total bytes
+    while (more && !conn.closing) {
+        // Start a task for every complete head already here (pipelining)
+        size_t start = 0, head_end;
+        while (more && (head_end = pending.find("\r\n\r\n", start)) != string::npos) {
+            co_await conn.below(PIPELINE_DEPTH);
+            if (conn.closing) break;
+            bool keep_client = clientKeepAlive(pending.substr(start, head_end + 4 - start))
+                && served + 1 < (uint64_t)client_max_requests;
+            serve_request(conn, served++, pending.data() + start, head_end + 4 - start, keep_client);
+            start = head_end + 4;
+            more = keep_client;
+        }
+        pending.erase(0, start);
+        if (!more || conn.closing) break;
+        if (pending.size() >= MAX_HEADER_SIZE) {
+            status = 400;
+            break;
+        }
 
-        // Check for End of Headers
-        if (raw_req.find("\r\n\r\n") != string::npos) {
-            header_complete = true;
+        // Fix C: Robust Header Accumulation, bounded by the idle timeout
+        // while no request is in flight
+        if (conn.in_flight == 0) conn.idle.arm(client_idle_timeout_ms);
+        conn.reading = true;
+        ssize_t n = co_await async_recv(loop, client_fd, buffer.data(), buffer.size());
+        conn.reading = false;
+        conn.idle.cancel();
+        if (n <= 0) {
+            // Connection closed or went idle, maybe part way into a head
+            if (!pending.empty() && !conn.closing) status = conn.idle.fired ? 408 : 400;
             break;
         }
+        pending.append(buffer.data(), n);
     }
 
-    if (header_complete) {
-        string cached_resp = cache.get(raw_req); 
+    co_await conn.below(1);
+    if (status > 0 && !conn.closing) {
+        string msg = buildErrorMessage(status);
+        co_await async_send_all(loop, client_fd, msg.data(), msg.size());
+    }
+    shutdown(client_fd, SHUT_RDWR);
+    loop.close(client_fd);
+    owner->connection_closed();
+}
 
-        if (!cached_resp.empty()) {
-            // HIT
-            send_all(socket, cached_resp.c_str(), cached_resp.size());
-            cout << "Data retrieved from the Cache" << endl;
-        } else {
-            // MISS
-            ParsedRequest* request = ParsedRequest_create();
-            // Use total_bytes/raw_req size
-            if (ParsedRequest_parse(request, raw_req.c_str(), raw_req.size()) < 0) {
-                sendErrorMessage(socket, 400);
+// ----------------------------------------------------------
+//  Handoff Queue (bounded lock-free MPMC)
+// ----------------------------------------------------------
+// Vyukov's array queue: each cell carries a sequence number that tells
+// producers and consumers whether it is free or filled for their lap.
+template <typename T>
+class MpmcQueue {
+private:
+    struct Cell {
+        atomic<size_t> seq;
+        T data;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueue_pos;
+    alignas(64) atomic<size_t> dequeue_pos;
+
+public:
+    MpmcQueue(size_t size) : cells(new Cell[size]), mask(size - 1), enqueue_pos(0), dequeue_pos(0) {
+        for (size_t i = 0; i < size; i++) cells[i].seq.store(i, memory_order_relaxed);
+    }
+
+    bool push(const T& v) {
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        while (1) {
+            Cell& c = cells[pos & mask];
+            intptr_t diff = (intptr_t)c.seq.load(memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    c.data = v;
+                    c.seq.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
             } else {
-                if (string(request->method) == "GET") {
-                     if (handle_request(socket, request, raw_req) == -1) {
-                         sendErrorMessage(socket, 500);
-                     }
-                } else {
-                    sendErrorMessage(socket, 501);
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T& v) {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        while (1) {
+            Cell& c = cells[pos & mask];
+            intptr_t diff = (intptr_t)c.seq.load(memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    v = c.data;
+                    c.seq.store(pos + mask + 1, memory_order_release);
+                    return true;
                 }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = dequeue_pos.load(memory_order_relaxed);
             }
-            ParsedRequest_destroy(request);
         }
-    } else {
-        // Did not receive full headers or connection closed early
-        if (total_bytes > 0) sendErrorMessage(socket, 400);
     }
 
-    shutdown(socket, SHUT_RDWR);
-    close(socket);
-    // guard destructor calls sem_post() here
-    return NULL;
-}
+    // A snapshot; a concurrent push or pop may change it right away.
+    bool empty() const {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        return cells[pos & mask].seq.load(memory_order_acquire) != pos + 1;
+    }
+};
 
 // ----------------------------------------------------------
-//  Main
+//  Worker Pool
 // ----------------------------------------------------------
-int main(int argc, char * argv[]) {
-    if (argc == 2) port_number = atoi(argv[1]);
-    printf("Setting Proxy Server Port : %d\n", port_number);
+// Pre-spawned event loop threads fed with accepted fds through one bounded
+// queue. A worker drains up to WORKER_BATCH fds per wakeup and passes the
+// doorbell on if more are waiting, so a burst spreads across the pool; a
+// worker at its connection limit passes it to one that has room.
+class WorkerPool {
+private:
+    static const int WORKER_BATCH = 16;
 
-    // Ignore SIGPIPE globally to prevent process crash on write to closed socket
-    // (Backup to MSG_NOSIGNAL)
-    signal(SIGPIPE, SIG_IGN); 
+    struct Worker : public ConnectionOwner {
+        WorkerPool* pool;
+        EventLoop* loop;
+        size_t active = 0;
+        size_t max_active = 0;
+        atomic<bool> full{false}; // read by other workers passing a wakeup on
+
+        void drain() {
+            int fd;
+            int taken = 0;
+            while (active < max_active && taken < WORKER_BATCH && pool->queue.pop(fd)) {
+                active++;
+                taken++;
+                handle_client(*loop, fd, this);
+            }
+            full.store(active >= max_active, memory_order_relaxed);
+            if (taken == WORKER_BATCH) {
+                pool->wake_one();
+            } else if (active >= max_active && !pool->queue.empty()) {
+                // Left waiting here, the fds would sit until one of our
+                // connections closes.
+                pool->wake_other(this);
+            }
+        }
+
+        void connection_closed() override {
+            active--;
+            if (active + 1 == max_active) drain();
+        }
+    };
 
-    sem_init(&seamaphore, 0, MAX_CLIENTS);
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
+    MpmcQueue<int> queue;
+    vector<Worker> workers;
+    atomic<unsigned> next_worker;
+
+public:
+    WorkerPool(int nworkers, const string& backend) : queue(HANDOFF_QUEUE_SIZE), workers(nworkers), next_worker(0) {
+        size_t per_worker = max(1, MAX_CLIENTS / nworkers);
+        for (Worker& w : workers) {
+            w.pool = this;
+            w.loop = createEventLoop(backend);
+            w.max_active = per_worker;
+            w.loop->on_notify = [&w]() { w.drain(); };
+        }
+    }
+
+    EventLoop* loop(int i) { return workers[i].loop; }
+
+    void start(int ncpus) {
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker& w = workers[i];
+            thread t([&w]() { w.loop->run(); });
+            pinToCpu(t, (int)i % ncpus);
+            t.detach();
+        }
+    }
+
+    void wake_one() {
+        unsigned i = next_worker.fetch_add(1, memory_order_relaxed) % workers.size();
+        workers[i].loop->notify();
+    }
+
+    // Wakes a worker other than self that has room for a connection. If
+    // none has, the first to close one drains the queue.
+    void wake_other(Worker* self) {
+        unsigned start = next_worker.fetch_add(1, memory_order_relaxed);
+        for (size_t k = 0; k < workers.size(); k++) {
+            Worker& w = workers[(start + k) % workers.size()];
+            if (&w != self && !w.full.load(memory_order_relaxed)) {
+                w.loop->notify();
+                return;
+            }
+        }
+    }
+
+    // Called from acceptor threads. Returns false when every worker is
+    // saturated and the queue is full.
+    bool submit(int fd) {
+        if (!queue.push(fd)) return false;
+        wake_one();
+        return true;
+    }
+};
+
+// ----------------------------------------------------------
+//  Acceptor
+// ----------------------------------------------------------
+// Without a worker pool the acceptor serves its own connections and stops
+// accepting while its share of MAX_CLIENTS is open; the listen backlog
+// absorbs the excess until a connection finishes. With a pool it only
+// accepts and hands fds off, shedding load with a 503 once the queue is full.
+class Acceptor : public IoHandler, public ConnectionOwner {
+private:
+    EventLoop& loop;
+    int listen_fd;
+    WorkerPool* pool;
+    size_t active;
+    size_t max_active;
+    bool paused;
+
+public:
+    Acceptor(EventLoop& l, int fd, WorkerPool* p, size_t max_conns)
+        : loop(l), listen_fd(fd), pool(p), active(0), max_active(max_conns), paused(false) {}
+
+    void start() {
+        paused = false;
+        loop.accept(listen_fd, this, 0);
+    }
+
+    void on_io(int, ssize_t res) override {
+        if (res >= 0 && pool) {
+            if (!pool->submit((int)res)) {
+                string msg = buildErrorMessage(503);
+                ::send((int)res, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+                ::close((int)res);
+            }
+        } else if (res >= 0) {
+            active++;
+            handle_client(loop, (int)res, this);
+        } else if (res != -EINTR && res != -ECONNABORTED) {
+            errno = (int)-res;
+            perror("Error in Accepting connection");
+        }
+        if (active >= max_active) {
+            paused = true;
+            return;
+        }
+        loop.accept(listen_fd, this, 0);
+    }
+
+    void connection_closed() override {
+        active--;
+        if (paused) start();
+    }
+};
+
+// ----------------------------------------------------------
+//  Listeners
+// ----------------------------------------------------------
+// With more than one listener every socket sets SO_REUSEPORT so the kernel
+// spreads incoming connections across them, and SO_INCOMING_CPU so a
+// listener is preferred for connections whose packets land on its core.
+int createListenSocket(int flags, bool reuseport, int cpu) {
+    int proxy_socketId = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
     if (proxy_socketId < 0) exit(1);
 
     int reuse = 1;
     setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    if (reuseport) {
+        if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) {
+            perror("SO_REUSEPORT failed");
+            exit(1);
+        }
+        setsockopt(proxy_socketId, SOL_SOCKET, SO_INCOMING_CPU, (const char*)&cpu, sizeof(cpu));
+    }
 
     struct sockaddr_in server_addr;
     bzero((char*)&server_addr, sizeof(server_addr));
@@ -300,33 +4669,116 @@ int main(int argc, char * argv[]) {
         exit(1);
     }
 
-    if (listen(proxy_socketId, MAX_CLIENTS) < 0) {
+    if (listen(proxy_socketId, SOMAXCONN) < 0) {
         perror("Listen failed");
         exit(1);
     }
-    printf("Server Listening...\n");
+    return proxy_socketId;
+}
 
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int client_socketId;
-    
-    while (1) {
-        client_socketId = accept(proxy_socketId, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socketId < 0) {
-            if (errno == EINTR) continue; // Handle signal interrupt
-            perror("Error in Accepting connection");
-            continue;
+// ----------------------------------------------------------
+//  Main
+// ----------------------------------------------------------
+int main(int argc, char * argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:l:w:c:r:t:n:H:u:U:k:m:o:S:E:a:")) != -1) {
+        switch (opt) {
+            case 'b': io_backend = optarg; break;
+            case 'l': num_listeners = max(1, atoi(optarg)); break;
+            case 'w': num_workers = max(0, atoi(optarg)); break;
+            case 'c': cache_storage = optarg; break;
+            case 'r': BufferPool::relay_size = min(max(atoi(optarg), 1024), 256 * 1024); break;
+            case 't': connect_timeout_ms = max(1, atoi(optarg)); break;
+            case 'n': nameserver = optarg; break;
+            case 'H': hosts_file = optarg; break;
+            case 'u': UpstreamPool::max_idle = max(0, atoi(optarg)); break;
+            case 'U': UpstreamPool::idle_timeout_ms = max(1, atoi(optarg)); break;
+            case 'k': client_idle_timeout_ms = max(1, atoi(optarg)); break;
+            case 'm': client_max_requests = max(1, atoi(optarg)); break;
+            case 'o': max_object_size = strtoull(optarg, NULL, 10); break;
+            case 'S': cache_shards = max(1, atoi(optarg)); break;
+            case 'E': eviction_policy = optarg; break;
+            case 'a': admission_window = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-b epoll|uring] [-l listeners] [-w workers] [-c heap|memfd] [-r relay_bytes] [-t connect_timeout_ms] [-n nameserver[:port]] [-H hosts_file] [-u upstream_idle_per_host] [-U upstream_idle_ms] [-k client_idle_ms] [-m max_requests] [-o max_object_bytes] [-S cache_shards] [-E lru|clock|arc|s3fifo|tinylfu] [-a admission_window] [port]\n", argv[0]);
+                exit(1);
         }
+    }
+    cache.set_memfd_storage(cache_storage == "memfd");
+    cache.set_shards(cache_shards);
+    cache.set_admission_window(admission_window);
+    if (!cache.set_policy(eviction_policy)) {
+        fprintf(stderr, "Unknown eviction policy %s, using %s\n", eviction_policy.c_str(), EVICTION_POLICY);
+    }
+    cache.set_max_object(max_object_size);
+    if (optind < argc) port_number = atoi(argv[optind]);
+    printf("Setting Proxy Server Port : %d\n", port_number);
+
+    // Ignore SIGPIPE globally to prevent process crash on write to closed socket
+    // (Backup to MSG_NOSIGNAL)
+    signal(SIGPIPE, SIG_IGN);
 
-        int* client_sock_ptr = new int(client_socketId); 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, thread_fn, (void*)client_sock_ptr) != 0) {
-            perror("Failed to create thread");
-            delete client_sock_ptr;
-            close(client_socketId);
+    // SIGUSR1 prints cache, buffer pool and resolver counters; only the stats thread receives it,
+    // so block it before any other thread starts.
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    thread([usr1]() {
+        int sig;
+        while (sigwait(&usr1, &sig) == 0) {
+            cache.report(stdout);
+            BufferPool::report(stdout);
+            resolver.report(stdout);
         }
+    }).detach();
+
+    // Each connection holds up to two fds; raise the soft limit as far as allowed.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    resolver.start(nameserver, hosts_file);
+
+    int ncpus = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    WorkerPool* pool = NULL;
+    if (num_workers > 0) {
+        pool = new WorkerPool(num_workers, io_backend);
+        for (int i = 0; i < num_workers; i++) scheduler.add_worker(pool->loop(i));
+    }
+
+    // One event loop, listening socket and acceptor per listener.
+    vector<EventLoop*> loops;
+    vector<Acceptor*> acceptors;
+    for (int i = 0; i < num_listeners; i++) {
+        EventLoop* loop = createEventLoop(io_backend);
+        int listen_fd = createListenSocket(loop->sock_flags, num_listeners > 1, i % ncpus);
+        loops.push_back(loop);
+        acceptors.push_back(new Acceptor(*loop, listen_fd, pool, max(1, MAX_CLIENTS / num_listeners)));
+        if (!pool) scheduler.add_worker(loop);
+    }
+    if (pool) pool->start(ncpus);
+    printf("I/O backend: %s, listeners: %d, workers: %d, cache storage: %s\n",
+           dynamic_cast<UringLoop*>(loops[0]) ? "uring" : "epoll", num_listeners, num_workers,
+           cache_storage == "memfd" ? "memfd" : "heap");
+    printf("Server Listening...\n");
+
+    if (num_listeners == 1) {
+        acceptors[0]->start();
+        loops[0]->run();
+        return 0;
     }
 
-    close(proxy_socketId);
+    vector<thread> threads;
+    for (int i = 0; i < num_listeners; i++) {
+        threads.emplace_back([i, &loops, &acceptors]() {
+            acceptors[i]->start();
+            loops[i]->run();
+        });
+        pinToCpu(threads.back(), i % ncpus);
+    }
+    for (auto& t : threads) t.join();
     return 0;
 }